@@ -0,0 +1,417 @@
+// Tests for the editor's internals. warm.c is included whole so every
+// function is reachable; each test sets E up with rows of its own.
+#define main warmMain
+#include "../warm.c"
+#undef main
+
+static int failures = 0;
+
+#define CHECK(condition) do { \
+    if (!(condition)) { \
+        printf("%s:%d: %s failed\n", __FILE__, __LINE__, #condition); \
+        failures++; \
+    } \
+} while (0)
+
+void testLoadRows(char** lines, int count) {
+    initEditor();
+    for (int j = 0; j < count; j++)
+        editorInsertRow(E.num_rows, lines[j], strlen(lines[j]));
+    E.dirty = 0;
+}
+
+void testSetMacro(int* keys, int count) {
+    free(E.macro);
+    E.macro = malloc(sizeof(int) * count);
+    memcpy(E.macro, keys, sizeof(int) * count);
+    E.macro_length = count;
+}
+
+// Runs the background work of the editor (loading, indexing) to the end
+void testIdle() {
+    while (editorIdleWork() || E.loading)
+        ;
+}
+
+// Replaying until a search fails must end after the last match below the
+// cursor, without wrapping back to the top
+void testMacroUntilSearchFails() {
+    char* lines[] = { "#ERROR one", "fine", "ERROR two", "ok", "ERROR three" };
+    testLoadRows(lines, 5);
+    E.cursor_y = 0;
+    E.cursor_x = 1;
+
+    int keys[] = { CTRL_KEY('f'), 'E', 'R', 'R', 'O', 'R', '\r', HOME_KEY, '#' };
+    testSetMacro(keys, sizeof(keys) / sizeof(keys[0]));
+    editorRunMacro(0);
+
+    CHECK(!strcmp(E.row[0].text->line, "#ERROR one"));
+    CHECK(!strcmp(E.row[2].text->line, "#ERROR two"));
+    CHECK(!strcmp(E.row[4].text->line, "#ERROR three"));
+    CHECK(!strcmp(E.status_message, "Macro replayed 2 times"));
+}
+
+// Rows edited during a batched replay are rendered at its end, also when a
+// row above them was deleted after the edit
+void testBatchDeleteAboveStaleRow() {
+    char* lines[] = { "x", "y", "z" };
+    testLoadRows(lines, 3);
+
+    E.batch = 1;
+    editorRowInsertChar(&E.row[2], 0, '#');
+    editorDeleteRow(0);
+    CHECK(E.stale_first == 1 && E.stale_last == 1);
+
+    // Replaying an empty macro ends the batch
+    E.macro_length = 0;
+    editorRunMacro(1);
+    CHECK(!E.row[1].text->render_stale && E.row[1].text->render_size == 2);
+    CHECK(!strncmp(E.row[1].text->render_line, "#z", 2));
+}
+
+// Column marks give the same columns as one column per rendered byte, and
+// a row with one multibyte character keeps a single mark
+void testColumnMarks() {
+    char* lines[] = { "caf\xc3\xa9 ok", "\xe4\xb8\xad\xe6\x96\x87" "ab\xe4\xb8\xad", "e\xcc\x81\tx\xff",
+                      "\xf0\x9f\x98\x80!", "plain", "\xff\xfe" };
+    testLoadRows(lines, 6);
+    CHECK(E.row[0].text->column_marks == 1);
+    CHECK(E.row[4].text->columns == NULL && E.row[5].text->columns == NULL);
+
+    for (int y = 0; y < E.num_rows; y++) {
+        editorRow* row = &E.row[y];
+        int* columns = malloc(sizeof(int) * (row->text->render_size + 1));
+        int column = 0;
+        for (int j = 0; j < row->text->render_size; ) {
+            int codepoint;
+            int length = editorDecodeUtf8(&row->text->render_line[j], row->text->render_size - j, &codepoint);
+            int width = length ? editorCharWidth(codepoint) : 1;
+            if (!length) length = 1;
+            for (int k = 0; k < length; k++)
+                columns[j + k] = column;
+            column += width;
+            j += length;
+        }
+        columns[row->text->render_size] = column;
+
+        CHECK(row->render_width == column);
+        for (int j = 0; j <= row->text->render_size; j++)
+            CHECK(editorRowColumn(row, j) == columns[j]);
+        for (int c = 0; c <= column + 2; c++) {
+            int at = 0;
+            while (at < row->text->render_size && columns[at] < c) at++;
+            CHECK(editorRowIndexAt(row, c) == at);
+        }
+        free(columns);
+    }
+}
+
+// Backspace takes a multibyte character, with the marks combined with it,
+// as one edit
+void testDeleteMultibyteChar() {
+    char* lines[] = { "a\xc3\xa9", "e\xcc\x81x" };
+    testLoadRows(lines, 2);
+
+    E.cursor_y = 0;
+    E.cursor_x = 3;
+    editorDeleteChar();
+    CHECK(!strcmp(E.row[0].text->line, "a") && E.row[0].size == 1);
+    CHECK(E.cursor_x == 1);
+    CHECK(E.dirty == 1);
+
+    E.cursor_y = 1;
+    E.cursor_x = 3;
+    editorDeleteChar();
+    CHECK(!strcmp(E.row[1].text->line, "x") && E.row[1].render_width == 1);
+    CHECK(E.cursor_x == 0);
+    CHECK(E.dirty == 2);
+}
+
+// A row exactly as wide as the screen takes one display line, with or
+// without wide characters
+void testWrapExactWidth() {
+    char* lines[] = { "", "0123456789", "0123456789a", "\xe4\xb8\xad\xe4\xb8\xad\xe4\xb8\xad\xe4\xb8\xad\xe4\xb8\xad",
+                      "\xe4\xb8\xad\xe4\xb8\xad\xe4\xb8\xad\xe4\xb8\xad" "0" "\xe4\xb8\xad" };
+    testLoadRows(lines, 0);
+    E.screen_cols = 10;
+    E.wrap = 1;
+    for (int j = 0; j < 5; j++)
+        editorInsertRow(E.num_rows, lines[j], strlen(lines[j]));
+
+    CHECK(E.row[0].wrap_lines == 1);
+    CHECK(E.row[1].wrap_lines == 1);
+    CHECK(E.row[2].wrap_lines == 2);
+    CHECK(E.row[3].wrap_lines == 1);
+    // The last wide character doesn't fit after column 9 and moves down
+    CHECK(E.row[4].wrap_lines == 2);
+    CHECK(editorDisplayLines() == 7);
+
+    // The cursor at the end of the full row stays on its line
+    E.cursor_y = 1;
+    E.cursor_x = 10;
+    editorScroll();
+    CHECK(E.render_y == 1);
+    CHECK(E.render_x == 9);
+}
+
+// Unloading a buffer gives back its trigram and word indexes, and reading
+// it back builds them again
+void testUnloadFreesIndexes() {
+    char path[] = "/tmp/warm_testXXXXXX";
+    int fd = mkstemp(path);
+    char text[] = "alpha beta\ngamma alphabet\n";
+    CHECK(fd != -1 && write(fd, text, sizeof(text) - 1) == sizeof(text) - 1);
+    close(fd);
+
+    initEditor();
+    E.trigram = 1;
+    E.trigram_table = calloc(TRIGRAM_BUCKETS, sizeof(trigramPosting));
+    editorOpen(path);
+    testIdle();
+    CHECK(E.num_rows == 2);
+    CHECK(E.word_count == 4);
+    CHECK(editorTrigramReady("alpha"));
+    long long postings = E.trigram_postings;
+    CHECK(postings > 0);
+
+    editorUnloadFile();
+    CHECK(E.trigram_table == NULL && E.id_rows == NULL && E.trigram_postings == 0);
+    CHECK(E.word_table == NULL && E.word_count == 0);
+
+    editorEnterBuffer();
+    testIdle();
+    CHECK(E.num_rows == 2);
+    CHECK(E.word_count == 4);
+    CHECK(E.trigram_table && editorTrigramReady("alpha"));
+    CHECK(E.trigram_postings == postings);
+    unlink(path);
+}
+
+// Deleting rows across the position of the initial trigram build moves it
+// back by the rows it had passed, so the rows after it still get indexed
+void testDeleteDuringTrigramBuild() {
+    initEditor();
+    E.trigram = 1;
+    E.trigram_table = calloc(TRIGRAM_BUCKETS, sizeof(trigramPosting));
+    for (int j = 0; j < 20000; j++) {
+        char line[16];
+        int length = snprintf(line, sizeof(line), "row%d", j);
+        editorInsertRow(E.num_rows, line, length);
+    }
+    editorTrigramBuild();
+    CHECK(E.trigram_next == TRIGRAM_SCAN_ROWS);
+
+    editorDeleteRows(0, 10000);
+    CHECK(E.trigram_next == 0);
+    while (editorTrigramBuild())
+        ;
+    CHECK(editorTrigramFind("row10001", -1, 1) == 1);
+}
+
+// The same for the word index
+void testDeleteDuringWordBuild() {
+    initEditor();
+    for (int j = 0; j < 12; j++) {
+        char line[16];
+        int length = snprintf(line, sizeof(line), "word%dxyz", j);
+        editorInsertRow(E.num_rows, line, length);
+    }
+    for (int j = 0; j < 5; j++)
+        editorWordsAddRow(&E.row[j]);
+    E.word_next = 5;
+
+    editorDeleteRows(0, 10);
+    CHECK(E.word_next == 0);
+    while (editorWordsBuild())
+        ;
+    int ids[WORD_COMPLETIONS];
+    int count = editorWordsComplete("word1", ids, WORD_COMPLETIONS);
+    CHECK(count == 2 && !strcmp(E.word_table[ids[0]].text, "word10xyz") &&
+          !strcmp(E.word_table[ids[1]].text, "word11xyz"));
+}
+
+int testTempFile(char* path, char* text) {
+    int fd = mkstemp(path);
+    CHECK(fd != -1 && write(fd, text, strlen(text)) == (ssize_t) strlen(text));
+    return fd;
+}
+
+// A regular file read as "-" ends with its last line, terminated or not
+void testStreamFileEnds() {
+    char path[] = "/tmp/warm_testXXXXXX";
+    close(testTempFile(path, "a\nb\r\npartial"));
+
+    initEditor();
+    editorFollow(open(path, O_RDONLY), 0);
+    CHECK(E.stream_fd == -1);
+    CHECK(E.num_rows == 3);
+    CHECK(!strcmp(E.row[1].text->line, "b") && !strcmp(E.row[2].text->line, "partial"));
+    CHECK(editorCanLeaveBuffer());
+    unlink(path);
+}
+
+// A followed file shows its unterminated last line until it is finished,
+// and is read again from the start once truncated
+void testFollowPartialAndTruncate() {
+    char path[] = "/tmp/warm_testXXXXXX";
+    int writer = testTempFile(path, "one\ntw");
+
+    initEditor();
+    E.filename = strdup(path);
+    editorFollow(open(path, O_RDONLY), 1);
+    CHECK(E.stream_fd != -1);
+    CHECK(E.num_rows == 2 && !strcmp(E.row[1].text->line, "tw"));
+
+    CHECK(write(writer, "o\r\nthree\n", 9) == 9);
+    editorReadStream();
+    CHECK(E.num_rows == 3);
+    CHECK(!strcmp(E.row[1].text->line, "two") && !strcmp(E.row[2].text->line, "three"));
+    CHECK(!E.dirty);
+
+    CHECK(ftruncate(writer, 0) == 0);
+    CHECK(pwrite(writer, "new\n", 4, 0) == 4);
+    editorReadStream();
+    CHECK(E.num_rows == 1 && !strcmp(E.row[0].text->line, "new"));
+
+    close(writer);
+    close(E.stream_fd);
+    unlink(path);
+}
+
+// What the rows hold, counted row by row
+long long testRowBytes() {
+    long long bytes = 0;
+    for (int j = 0; j < E.num_rows; j++)
+        bytes += editorRowBytes(&E.row[j]);
+    return bytes;
+}
+
+// The running byte count of a buffer matches what its rows hold through
+// edits, freezing, thawing, word indexing, eviction and deletes
+void testRowBytesFollowRows() {
+    initEditor();
+    for (int j = 0; j < 3000; j++) {
+        char line[64];
+        int length = snprintf(line, sizeof(line), j % 3 ? "\tword%d caf\xc3\xa9 %d" : "row %d of many", j, j * 7);
+        editorInsertRow(E.num_rows, line, length);
+    }
+    while (editorWordsBuild())
+        ;
+    CHECK(E.row_bytes == testRowBytes());
+
+    editorFreezeRows(100, 1000);
+    CHECK(E.row[500].cold);
+    CHECK(E.row_bytes == testRowBytes());
+
+    editorRowThaw(&E.row[500]);
+    editorRowInsertChar(&E.row[500], 0, '\t');
+    editorRowAppendString(&E.row[2000], " more words", 11);
+    editorRowDeleteChar(&E.row[2001], 0, 1);
+    editorDeleteRows(900, 300);
+    editorDeleteRow(10);
+    CHECK(E.row_bytes == testRowBytes());
+
+    editorBufferEvict(&E);
+    CHECK(E.row[2000].text->render_line == NULL);
+    CHECK(E.row_bytes == testRowBytes());
+
+    editorCloseFile();
+    CHECK(E.row_bytes == 0);
+}
+
+// An inactive buffer with unsaved changes that is over the memory budget
+// keeps its edited row and gets the rest back when switched to
+void testSpillEditedBuffer() {
+    char edited[] = "/tmp/warm_testXXXXXX";
+    char other[] = "/tmp/warm_testXXXXXX";
+    char text[2048] = "";
+    for (int j = 0; j < 60; j++)
+        snprintf(text + strlen(text), sizeof(text) - strlen(text), "line %d word%d\n", j, j % 7);
+    close(testTempFile(edited, text));
+    close(testTempFile(other, "other\n"));
+
+    initEditor();
+    editorOpen(edited);
+    testIdle();
+    editorFreezeRows(20, 30);
+    editorRowAppendString(&E.row[3], " changed", 8);
+    E.dirty++;
+    E.memory_budget = 0;
+    CHECK(editorOpenBuffer(other));
+
+    struct editorConfig* spilled = &E.buffers[0];
+    CHECK(spilled->spill != NULL);
+    CHECK(spilled->row[0].text == NULL && spilled->row[25].cold == NULL);
+    CHECK(spilled->row[3].text != NULL);
+    CHECK(strstr(E.status_message, "over the 0 MB budget") != NULL);
+
+    CHECK(editorSwitchBuffer(0));
+    CHECK(E.spill == NULL && E.dirty);
+    CHECK(!strcmp(E.row[3].text->line, "line 3 word3 changed"));
+    CHECK(!strcmp(editorRowLine(&E.row[25]), "line 25 word4"));
+    CHECK(!strcmp(editorRowLine(&E.row[59]), "line 59 word3"));
+    CHECK(E.row[59].words == 2 && E.row[59].text->word_ids != NULL);
+    CHECK(E.row_bytes == testRowBytes());
+    unlink(edited);
+    unlink(other);
+}
+
+// Folds follow rows being added and deleted instead of opening, and folding
+// updates the display index in place
+void testFoldsFollowEdits() {
+    char* lines[] = { "a", "head {", "  b", "  c", "}", "d", "e" };
+    testLoadRows(lines, 7);
+    editorFold(1, 4);
+    editorRowToDisplay(0);
+    editorUnfold(1);
+    CHECK(!E.display_tree_stale && editorRowToDisplay(5) == 5);
+    editorFold(1, 4);
+    CHECK(!E.display_tree_stale);
+    CHECK(editorRowToDisplay(5) == 2 && editorDisplayToRow(2) == 5);
+
+    editorInsertRow(3, "  new", 5);
+    CHECK(editorFoldRows(1) == 4 && E.row[3].hidden && E.folded_rows == 4);
+    editorDeleteRow(0);
+    CHECK(editorFoldRows(0) == 4);
+    editorDeleteRow(2);
+    CHECK(editorFoldRows(0) == 3 && E.folded_rows == 3);
+
+    // Joining the folded row onto the one above moves the fold there
+    editorInsertRow(0, "x", 1);
+    E.cursor_y = 1;
+    E.cursor_x = 0;
+    editorDeleteChar();
+    CHECK(!strcmp(E.row[0].text->line, "xhead {"));
+    CHECK(editorFoldRows(0) == 3 && E.row[1].hidden && !E.row[4].hidden);
+
+    char drop[] = { 0, 1, 0, 0, 1, 0 };
+    editorDeleteMarked(drop);
+    CHECK(editorFoldRows(0) == 2 && !strcmp(E.row[3].text->line, "e"));
+    CHECK(editorRowToDisplay(3) == 1);
+
+    editorDeleteRow(0);
+    CHECK(E.folds == 0 && E.folded_rows == 0 && !E.row[0].hidden);
+}
+
+int main() {
+    testMacroUntilSearchFails();
+    testBatchDeleteAboveStaleRow();
+    testWrapExactWidth();
+    testDeleteMultibyteChar();
+    testColumnMarks();
+    testUnloadFreesIndexes();
+    testDeleteDuringTrigramBuild();
+    testDeleteDuringWordBuild();
+    testStreamFileEnds();
+    testFollowPartialAndTruncate();
+    testRowBytesFollowRows();
+    testSpillEditedBuffer();
+    testFoldsFollowEdits();
+
+    if (failures) {
+        printf("%d checks failed\n", failures);
+        return 1;
+    }
+    printf("All tests passed\n");
+    return 0;
+}
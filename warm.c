@@ -12,10 +12,24 @@
 #include <termios.h>
 #include <errno.h>
 #include <sys/ioctl.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <string.h>
 #include <time.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <regex.h>
+#include <signal.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 
 /*** Data ***/
 
@@ -29,29 +43,327 @@ struct editorSyntax {
     int flags;
 };
 
-typedef struct editorRow {
-    int index;
+// A run of characters sharing one highlight class. Rows keep only the runs
+// that are not HIGHLIGHT_NORMAL.
+typedef struct highlightSpan {
+    int start;
+    int length;
+    unsigned char type;
+} highlightSpan;
+
+// A character whose bytes and display columns don't pair up one to one,
+// multibyte or wide. Rows list these instead of a column for every byte.
+typedef struct columnMark {
+    int offset;
+    int column;
+    unsigned char length;
+    unsigned char width;
+} columnMark;
+
+// A folded block: the header row stays shown, the rows after it are hidden
+typedef struct foldRange {
+    int header;
+    int rows;
+} foldRange;
+
+// Compressed text of a run of rows that have not been looked at in a while
+typedef struct coldBlock {
+    char* data;
+    int compressed_size;
+    int raw_size;
+    int rows;
+} coldBlock;
+
+// Ids of the rows containing one hashed trigram, in the order they were indexed
+typedef struct trigramPosting {
+    int* ids;
     int size;
-    int render_size;
+    int cap;
+} trigramPosting;
+
+// A distinct word of the text and the number of rows containing it
+typedef struct wordEntry {
+    char* text;
+    int length;
+    int rows;
+    unsigned int hash;
+} wordEntry;
+
+// Complete lines read by the loader thread, each ending in '\n'
+typedef struct loadChunk {
+    char* data;
+    int length;
+    struct loadChunk* next;
+} loadChunk;
+
+// A row's sort key: text from the key column to the end of the line, with
+// its first bytes packed into prefix so most comparisons stay in the array
+typedef struct sortKey {
+    unsigned long long prefix;
+    char* text;
+    int length;
+    double number;
+    int row;
+} sortKey;
+
+// One thread's share of a sort: sort keys [from, to), or merge the sorted
+// runs [from, middle) and [middle, to)
+typedef struct sortJob {
+    sortKey* keys;
+    sortKey* scratch;
+    int from;
+    int middle;
+    int to;
+    int numeric;
+    int reverse;
+} sortJob;
+
+// Sidecar cache of a file's highlighting state, valid while the file's
+// size, mtime and inode match. Followed by the path and one bit per row
+// saying whether the row ends inside a multiline comment.
+typedef struct openCacheHeader {
+    char magic[8];
+    unsigned long long size;
+    unsigned long long inode;
+    long long mtime_sec;
+    long long mtime_nsec;
+    int rows;
+    int path_length;
+    char filetype[16];
+} openCacheHeader;
+
+typedef struct grepHit {
+    char* path;
+    int line;
+    int column;
+    int length;
+    char* text;
+    struct grepHit* next;
+} grepHit;
+
+// A project search: the walker thread queues file paths, workers search
+// them and queue hits, and the results view takes the hits while polling
+typedef struct grepSearch {
+    char* query;
+    char* pattern;
+    int pattern_length;
+    int regex;
+    int flags;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    char** paths;
+    int path_count;
+    int path_cap;
+    int path_next;
+    int walked;
+    int cancel;
+    int running;
+    grepHit* head;
+    grepHit* tail;
+    int found;
+    int files;
+    int binary;
+    grepHit** hits;
+    int hit_count;
+    int hit_cap;
+    char title[80];
+    pthread_t walker;
+    pthread_t* workers;
+    int worker_count;
+} grepSearch;
+
+// The text of a warm row and what is derived from it. Cold rows have none:
+// their text is in a compressed block and the rest is made again on thaw.
+typedef struct rowText {
     char *line;
     char *render_line;
-    unsigned char* highlight;
-    int highlight_open_comment;
+    columnMark* columns;
+    highlightSpan* highlight;
+    int* word_ids;
+    int render_size;
+    int highlight_spans;
+    int column_marks;
+    int edited_at;
+    int bytes;
+    unsigned char render_alias;
+    unsigned char render_stale;
+} rowText;
+
+// What every row keeps, cold or not: where it is, its size and hashes, and
+// its place in the display, the folds and the indexes
+typedef struct editorRow {
+    rowText* text;
+    coldBlock* cold;
+    unsigned long long hash;
+    unsigned long long saved_hash;
+    int index;
+    int size;
+    int render_width;
+    int wrap_lines;
+    int cold_offset;
+    int hidden;
+    int id;
+    int trigrams;
+    int words;
+    int removed_before;
+    unsigned char highlight_open_comment;
+    unsigned char highlight_stale;
+    unsigned char saved;
 } editorRow;
 
+typedef struct editorCursor {
+    int y;
+    int x;
+} editorCursor;
+
+// Lines shown by a modal view, each with a color and a caller-defined tag,
+// and optionally a match to highlight. Views whose lines are still being
+// produced have an update function, polled between keys.
+typedef struct editorView {
+    char* title;
+    char** lines;
+    int* colors;
+    int* tags;
+    int count;
+    int cap;
+    int* match_starts;
+    int* match_lengths;
+    int (*update)(struct editorView* view);
+    void* data;
+} editorView;
+
 struct editorConfig {
     int cursor_x;
     int cursor_y;
     int render_x;
+    int render_y;
     int col_offset;
     int row_offest;
     int screen_rows;
     int screen_cols;
+    int drawn_row_offset;
+    int drawn_col_offset;
+    int drawn_first_row;
+    int drawn_last_row;
+    int redraw;
+    int fps;
+    long long last_frame;
     int num_rows;
     struct editorRow* row;
     char* filename;
     int dirty;
 
+    int watch_fd;
+    int watch_wd;
+    char* watch_name;
+    struct stat disk_state;
+    int disk_changed;
+
+    int stream_fd;
+    int stream_poll;
+    int stream_follow;
+    int stream_provisional;
+    int max_lines;
+
+    int loading;
+    int load_fd;
+    int load_pipe[2];
+    pthread_t load_thread;
+    pthread_mutex_t load_lock;
+    pthread_cond_t load_space;
+    loadChunk* load_head;
+    loadChunk* load_tail;
+    int load_queued;
+    int load_finished;
+    int load_error;
+    int load_cancel;
+    loadChunk* load_chunk;
+    int load_offset;
+    long long load_size;
+    long long load_bytes;
+
+    unsigned char* open_cache;
+    int open_cache_rows;
+    int highlight_deferred;
+
+    int* macro;
+    int macro_length;
+    int macro_pos;
+    int recording;
+    int replaying;
+    int batch;
+    int stale_first;
+    int stale_last;
+    int search_failed;
+
+    int wrap;
+    int* display_tree;
+    int display_tree_size;
+    int display_tree_cap;
+    int display_tree_stale;
+
+    foldRange* fold_ranges;
+    int folds;
+    int folds_cap;
+    int folded_rows;
+
+    int gutter;
+    int removed_tail;
+
+    editorCursor* cursors;
+    int num_cursors;
+    int cursors_cap;
+    int block;
+    int block_y;
+    int block_column;
+
+    int goto_row;
+    int goto_column;
+    int goto_offset;
+
+    struct editorConfig* buffers;
+    int num_buffers;
+    int current_buffer;
+    int buffer_used;
+    int buffer_clock;
+    int open_pending;
+    long long memory_budget;
+    long long row_bytes;
+    FILE* spill;
+
+    int edit_generation;
+    int freeze_pending;
+    int freeze_next;
+    int frozen_rows;
+
+    int trigram;
+    trigramPosting* trigram_table;
+    int* id_rows;
+    unsigned char* id_hits;
+    int id_count;
+    int id_cap;
+    int* trigram_pending;
+    int trigram_pending_count;
+    int trigram_pending_cap;
+    int trigram_next;
+    long long trigram_postings;
+    long long trigram_garbage;
+    int trigram_version;
+    char* trigram_query;
+    int* trigram_candidates;
+    int trigram_candidate_count;
+    int trigram_candidates_version;
+
+    wordEntry* word_table;
+    int word_count;
+    int word_cap;
+    int* word_slots;
+    int word_slot_mask;
+    int* word_order;
+    int word_ordered;
+    int word_dead;
+    int word_next;
+
     char status_message[80];
     time_t status_message_time;
 
@@ -63,6 +375,46 @@ struct editorConfig E;
 
 /*** Defines ***/
 #define WARM_VERSION "0.1.0"
+#define WARM_DEFAULT_FPS 60
+
+#define COLD_MIN_ROWS 10000
+#define COLD_DISTANCE 2000
+#define COLD_EDIT_AGE 1024
+#define COLD_BLOCK_BYTES 65536
+#define COLD_SCAN_ROWS 16384
+
+#define LOAD_CHUNK_BYTES (1 << 20)
+#define LOAD_QUEUE_CHUNKS 16
+#define LOAD_SLICE_ROWS 4096
+
+#define OPEN_CACHE_MAGIC "warmoc1"
+#define OPEN_CACHE_MIN_ROWS 10000
+
+#define BUFFER_BUDGET_MB 512
+
+#define SERVER_HELLO_MS 1000
+
+#define DIFF_CONTEXT 3
+#define VIEW_POLL_MS 50
+
+#define SORT_MAX_THREADS 8
+#define SORT_PARALLEL_ROWS 65536
+
+#define GREP_MAX_THREADS 8
+#define GREP_MAX_HITS 100000
+#define GREP_LINE_BYTES 256
+#define GREP_BINARY_PROBE 8192
+
+#define TRIGRAM_BITS 18
+#define TRIGRAM_BUCKETS (1 << TRIGRAM_BITS)
+#define TRIGRAM_SCAN_ROWS 8192
+
+#define WORD_MIN_LENGTH 3
+#define WORD_MAX_LENGTH 64
+#define WORD_SCAN_ROWS 4096
+#define WORD_TAIL_MAX 1024
+#define WORD_COMPACT_MIN 65536
+#define WORD_COMPLETIONS 16
 
 #define CTRL_KEY(c) ((c) & 0x1f)
 
@@ -127,6 +479,9 @@ void editorUpdateSyntax(editorRow* row);
 int editorSyntaxToColor(int highlight);
 void editorSelectSyntaxHighlight();
 int isSeparator(int c);
+unsigned char* editorHighlightScratch(int size);
+void editorRowSetHighlight(editorRow* row, unsigned char* hl);
+unsigned char* editorRowExpandHighlight(editorRow* row);
 
 /*** Append Buffer ***/
 struct append_buffer {
@@ -140,9 +495,13 @@ void buffer_free(struct append_buffer *ab);
 
 /*** Output ***/
 int editorReadKey();
+int editorReadTerminalKey();
 void editorProcessKeypress();
 void editorRefreshScreen();
-void editorDrawRows(struct append_buffer *ab);
+void editorDrawRows(struct append_buffer *ab, int first, int last);
+void editorDrawSpans(struct append_buffer *ab, editorRow* row, int from, int to, int* span, int* current_color);
+void editorDrawText(struct append_buffer *ab, char* s, int length, int color, int* current_color);
+void editorInvalidateRows(int at, int count);
 int getWindowSize(int*, int*);
 void editorScroll();
 void editorDrawStatusBar(struct append_buffer *ab);
@@ -152,16 +511,30 @@ void editorSetStatusMessage(const char *fmt, ...);
 /*** Input ***/
 char *editorPrompt(char *prompt, void(*callback)(char*, int));
 void editorMoveCursor(int key);
+int editorInputPending(int timeout_ms);
+int editorKeyWaiting();
+int editorIdleWork();
+int editorFrameDelay();
+long long currentTimeMs();
 
 /*** Row Operations ***/
 void editorInsertRow(int at, char *s, size_t len);
 void editorDeleteRow(int at);
+void editorDeleteRows(int at, int count);
+void editorIndexesDropRows(int at, int count);
+void editorStaleDropRows(int at, int count);
 void editorFreeRow(editorRow* row);
+rowText* editorNewRowText(char* line, int size);
+void editorFreeRowText(editorRow* row);
+long long editorRowBytes(editorRow* row);
+void editorRowRecount(editorRow* row);
 void editorUpdateRow(editorRow* row);
+void editorRowRender(editorRow* row);
+void editorRowHighlight(editorRow* row);
 int editorCursorxToRenderx(editorRow* row, int cursor_x);
 int editorRenderxToCursorx(editorRow* row, int render_x);
 void editorRowInsertChar(editorRow *row, int at, int c);
-void editorRowDeleteChar(editorRow *row, int at);
+void editorRowDeleteChar(editorRow *row, int at, int length);
 void editorRowAppendString(editorRow *row, char* s, size_t scs_length);
 
 /*** Editor Operations ***/
@@ -171,29 +544,342 @@ void editorDeleteChar();
 
 /*** File I/O ***/
 void editorOpen(char* filename);
+void editorCloseFile();
+void editorOpenAt(char* filename, int line);
+void editorGotoPending();
+int editorReadLines(char* filename, char*** lines, size_t** lengths);
+void* editorLoadFile(void* arg);
+int editorLoadPush(char* data, int length);
+int editorLoadRows();
+void editorFinishLoad();
 char *editorRowsToString(int *buffer_length);
 void editorSave();
 
+/*** Open Cache ***/
+char* editorOpenCachePath();
+void editorReadOpenCache(struct stat* st);
+void editorWriteOpenCache(struct stat* st);
+void editorDropOpenCache();
+
+/*** File Watching ***/
+void editorWatchFile();
+void editorRecordDiskState();
+int editorDiskStateChanged();
+void editorHandleFileEvents();
+void editorReloadFromDisk();
+void editorOpenFollow(char* filename);
+void editorFollow(int fd, int follow);
+void editorReadStream();
+void editorAppendStreamRows(char* data, int length);
+
 /*** Find ***/
 void editorFindCallback(char* query, int key);
 void editorFind();
 
+/*** UTF-8 ***/
+int editorIsAscii(const char* s, int length);
+int editorDecodeUtf8(const char* s, int length, int* codepoint);
+int editorCharWidth(int codepoint);
+void editorRowMeasure(editorRow* row);
+int editorRowColumn(editorRow* row, int at);
+int editorRowIndexAt(editorRow* row, int column);
+int editorRowWrap(editorRow* row, int column, int line, int* line_start);
+int editorRowWrapLines(editorRow* row);
+int editorRowNextChar(editorRow* row, int at);
+int editorRowPrevChar(editorRow* row, int at);
+
+/*** Display Index ***/
+int editorDisplayMapped();
+int editorRowDisplayLines(editorRow* row);
+void editorRebuildDisplayIndex();
+void editorDisplayIndexAdd(int at, int delta);
+int editorRowToDisplay(int at);
+int editorDisplayToRow(int line);
+int editorDisplayLines();
+void editorRewrapRows();
+void editorToggleWrap();
+int editorPrevVisibleRow(int at);
+int editorNextVisibleRow(int at);
+
+/*** Folding ***/
+int editorRowBraceDepth(editorRow* row);
+int editorRowIndent(editorRow* row);
+int editorFoldEnd(int at);
+int editorFoldSearch(int at);
+int editorFoldRows(int at);
+void editorFoldHideRow(int at);
+void editorFoldShowRow(int at);
+void editorFoldListInsert(int header, int rows);
+void editorFoldListRemove(int k);
+void editorFold(int at, int end);
+void editorUnfold(int at);
+void editorUnfoldRange(int at, int count);
+int editorFoldsInsertRow(int at);
+void editorFoldsDropRows(int at, int count);
+void editorFoldsDropMarked(char* drop);
+void editorToggleFold();
+
+/*** Cold Rows ***/
+int coldCompress(const char* src, int length, char* dst);
+void coldDecompress(const char* src, int length, char* dst);
+char* editorColdBlockData(coldBlock* block);
+void editorColdRelease(coldBlock* block);
+char* editorRowLine(editorRow* row);
+int editorRowStripped(editorRow* row);
+void editorRowThaw(editorRow* row);
+void editorFreezeRows(int at, int count);
+int editorFreezeColdRows();
+
+/*** Trigram Index ***/
+int editorTrigramBucket(unsigned char a, unsigned char b, unsigned char c);
+void editorTrigramAddRow(editorRow* row);
+void editorTrigramQueue(int id);
+void editorTrigramNewRow(editorRow* row);
+void editorTrigramForget(editorRow* row);
+void editorTrigramDrop(editorRow* row);
+void editorTrigramRebuild();
+void editorTrigramFree();
+int editorTrigramBuild();
+int editorTrigramReady(char* query);
+int editorRowContains(editorRow* row, char* query);
+int compareInts(const void* a, const void* b);
+int editorTrigramFind(char* query, int last_match, int direction);
+
+/*** Word Index ***/
+int editorIsWordChar(unsigned char c);
+int editorWordFind(const char* s, int length, int add);
+void editorWordsGrow();
+int editorWordsCollect(const char* line, int size, int add);
+void editorWordsAddRow(editorRow* row);
+void editorWordsLink(editorRow* row);
+void editorWordsNewRow(editorRow* row);
+void editorWordsUpdate(editorRow* row);
+void editorWordsDrop(editorRow* row);
+void editorWordsReset();
+int editorWordCompare(const void* a, const void* b);
+void editorWordsMerge();
+void editorWordsCompact();
+int editorWordsBuild();
+int editorWordsComplete(char* prefix, int* ids, int max);
+void editorComplete();
+
+/*** Changes ***/
+unsigned long long editorHashLine(const char* s, int length);
+void editorRowMarkSaved(editorRow* row);
+void editorMarkSaved();
+void editorToggleGutter();
+void editorDrawGutter(struct append_buffer *ab, int file_row, int first_line);
+void diffBisect(unsigned long long* a, int n, unsigned long long* b, int m, int* v1, int* v2, int* x, int* y);
+void diffCompare(unsigned long long* a, int n, unsigned long long* b, int m, char* removed, char* added, int* v1, int* v2);
+void editorShowDiff();
+
+/*** Views ***/
+void editorViewAppend(editorView* view, int color, int tag, const char* fmt, ...);
+void editorViewMatch(editorView* view, int start, int length);
+void editorDrawView(editorView* view, int offset, int selected);
+int editorRunView(editorView* view);
+void editorFreeView(editorView* view);
+
+/*** Project Search ***/
+void editorGrep(char* args);
+void* grepWalk(void* arg);
+void grepWalkDirectory(grepSearch* search, char* directory);
+void* grepWorker(void* arg);
+void grepFile(grepSearch* search, char* path, regex_t* regex);
+int grepCancelled(grepSearch* search);
+int grepUpdate(editorView* view);
+
+/*** Filters ***/
+void editorCommand();
+int sortCompare(sortKey* a, sortKey* b, int numeric, int reverse);
+void sortMergeRuns(sortJob* job);
+void sortKeys(sortJob* job);
+void* sortThread(void* arg);
+void* mergeThread(void* arg);
+void sortParallel(sortKey* keys, int count, int numeric, int reverse);
+void editorSortRows(int numeric, int reverse, int column, char separator);
+void editorApplyOrder(sortKey* keys);
+void editorDeleteMarked(char* drop);
+void editorUniqRows();
+void editorFilterRows(char* pattern, int keep);
+
+/*** Cursors ***/
+int editorCursorCompare(const void* a, const void* b);
+void editorAddCursor(int y, int x);
+int editorCursorColumn();
+void editorClearCursors();
+void editorToggleBlock();
+void editorSetCursors(editorCursor* all, int count);
+editorCursor* editorAllCursors(int* count);
+int editorBlockToCursors(int cut);
+void editorCursorsEdit(int key);
+void editorCursorsMove(int key);
+int editorCursorsKeypress(int key);
+void editorCursorsFromPattern(char* pattern);
+int editorNextMark(int y, editorRow* row, int* index, int* from, int* to);
+
+/*** Buffers ***/
+void editorShareGlobals(struct editorConfig* from);
+int editorAddBuffer(char* filename);
+int editorFindBuffer(char* filename);
+int editorCanLeaveBuffer();
+int editorSwitchBuffer(int to);
+int editorOpenBuffer(char* filename);
+void editorPromptOpen();
+void editorNextBuffer();
+int editorDirtyBuffers();
+void editorLeaveBuffer();
+void editorEnterBuffer();
+void editorCancelLoad();
+void editorUnloadFile();
+long long editorBufferMemory(struct editorConfig* buffer);
+void editorEnforceBudget();
+void editorBufferEvict(struct editorConfig* buffer);
+void editorBufferUnload(struct editorConfig* buffer);
+int editorRowSpillable(editorRow* row);
+void editorSpillRows();
+void editorUnspillRows();
+
+/*** Server ***/
+int editorServerPath(char* path, size_t size, int create);
+int editorPeerIsUser(int socket);
+void editorServe(int trigram);
+void editorHold(char* filename, int channel, int trigram);
+void editorAttach(int client, char* hello);
+void editorRemote(char* filename, int fps);
+void editorRelay(int input, int output, int peer);
+int editorSendFd(int channel, int fd, char* message, int length);
+int editorReceiveFd(int channel, int* fd, char* message, int size);
+
+/*** Macros ***/
+void editorToggleRecording();
+void editorReplayMacro();
+void editorRunMacro(int count);
+
 /*** Init ***/
 void initEditor();
+void editorMeasureWindow();
+void editorRun();
 
 void initEditor() {
     E.cursor_x = 0;
     E.cursor_y = 0;
     E.render_x = 0; 
+    E.render_y = 0;
     E.col_offset = 0;
     E.row_offest = 0;
+    E.drawn_row_offset = 0;
+    E.drawn_col_offset = 0;
+    E.drawn_first_row = 0;
+    E.drawn_last_row = -1;
+    E.redraw = 1;
+    E.fps = WARM_DEFAULT_FPS;
+    E.last_frame = 0;
     E.num_rows = 0;
     E.row = NULL;
     E.filename = NULL;
     E.dirty = 0;
+    E.watch_fd = -1;
+    E.watch_wd = -1;
+    E.watch_name = NULL;
+    E.disk_changed = 0;
+    E.stream_fd = -1;
+    E.stream_poll = 0;
+    E.stream_follow = 0;
+    E.stream_provisional = 0;
+    E.max_lines = 0;
+    E.loading = 0;
+    E.load_fd = -1;
+    E.load_head = NULL;
+    E.load_tail = NULL;
+    E.load_queued = 0;
+    E.load_finished = 0;
+    E.load_error = 0;
+    E.load_cancel = 0;
+    E.load_chunk = NULL;
+    E.load_offset = 0;
+    E.load_size = 0;
+    E.load_bytes = 0;
+    E.open_cache = NULL;
+    E.open_cache_rows = 0;
+    E.highlight_deferred = 0;
+    E.macro = NULL;
+    E.macro_length = 0;
+    E.macro_pos = 0;
+    E.recording = 0;
+    E.replaying = 0;
+    E.batch = 0;
+    E.stale_first = -1;
+    E.stale_last = -1;
+    E.search_failed = 0;
+    E.wrap = 0;
+    E.display_tree = NULL;
+    E.display_tree_size = 0;
+    E.display_tree_cap = 0;
+    E.display_tree_stale = 1;
+    E.fold_ranges = NULL;
+    E.folds = 0;
+    E.folds_cap = 0;
+    E.folded_rows = 0;
+    E.gutter = 0;
+    E.removed_tail = 0;
+    E.cursors = NULL;
+    E.num_cursors = 0;
+    E.cursors_cap = 0;
+    E.block = 0;
+    E.block_y = 0;
+    E.block_column = 0;
+    E.goto_row = -1;
+    E.goto_column = 0;
+    E.goto_offset = -1;
+    E.buffers = NULL;
+    E.num_buffers = 1;
+    E.current_buffer = 0;
+    E.buffer_used = 0;
+    E.buffer_clock = 0;
+    E.open_pending = 0;
+    E.memory_budget = (long long) BUFFER_BUDGET_MB << 20;
+    E.row_bytes = 0;
+    E.spill = NULL;
+    E.edit_generation = 0;
+    E.freeze_pending = 0;
+    E.freeze_next = 0;
+    E.frozen_rows = 0;
+    E.trigram = 0;
+    E.trigram_table = NULL;
+    E.id_rows = NULL;
+    E.id_hits = NULL;
+    E.id_count = 0;
+    E.id_cap = 0;
+    E.trigram_pending = NULL;
+    E.trigram_pending_count = 0;
+    E.trigram_pending_cap = 0;
+    E.trigram_next = 0;
+    E.trigram_postings = 0;
+    E.trigram_garbage = 0;
+    E.trigram_version = 0;
+    E.trigram_query = NULL;
+    E.trigram_candidates = NULL;
+    E.trigram_candidate_count = 0;
+    E.trigram_candidates_version = -1;
+    E.word_table = NULL;
+    E.word_count = 0;
+    E.word_cap = 0;
+    E.word_slots = NULL;
+    E.word_slot_mask = 0;
+    E.word_order = NULL;
+    E.word_ordered = 0;
+    E.word_dead = 0;
+    E.word_next = 0;
     E.status_message[0] = '\0';
     E.status_message_time = 0;
     E.syntax = NULL;
+    // Measured once there is a terminal; server holders have none
+    E.screen_cols = 80;
+    E.screen_rows = 24 - 2;
+}
+
+void editorMeasureWindow() {
     if (getWindowSize(&E.screen_cols, &E.screen_rows) == -1) {
         die("getWindowSize failed");
     }
@@ -201,20 +887,95 @@ void initEditor() {
 }
 
 int main(int argc, char* argv[]) {
+    char* filename = NULL;
+    int fps = WARM_DEFAULT_FPS;
+    int follow = 0;
+    int max_lines = 0;
+    int trigram = 0;
+    int serve = 0;
+    long long budget = BUFFER_BUDGET_MB;
+    char** more_files = malloc(sizeof(char*) * argc);
+    int more_count = 0;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--fps") && i + 1 < argc) {
+            fps = atoi(argv[++i]);
+            if (fps <= 0) fps = WARM_DEFAULT_FPS;
+        } else if (!strcmp(argv[i], "--follow")) {
+            follow = 1;
+        } else if (!strcmp(argv[i], "--max-lines") && i + 1 < argc) {
+            max_lines = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--index")) {
+            trigram = 1;
+        } else if (!strcmp(argv[i], "--server")) {
+            serve = 1;
+        } else if (!strcmp(argv[i], "--memory-budget") && i + 1 < argc) {
+            budget = atoll(argv[++i]);
+            if (budget <= 0) budget = BUFFER_BUDGET_MB;
+        } else if (filename) {
+            more_files[more_count++] = argv[i];
+        } else {
+            filename = argv[i];
+        }
+    }
+
+    if (serve) editorServe(trigram);
+
+    // Plain opens go through a running server, if there is one
+    if (filename && strcmp(filename, "-") && !follow && !max_lines && !trigram && !more_count)
+        editorRemote(filename, fps);
+
+    // "-" reads the document from a pipe, so keys have to come from the tty
+    int stream_fd = -1;
+    if (filename && !strcmp(filename, "-")) {
+        stream_fd = dup(STDIN_FILENO);
+        int tty = open("/dev/tty", O_RDWR);
+        if (stream_fd == -1 || tty == -1 || dup2(tty, STDIN_FILENO) == -1) {
+            perror("can't read from stdin");
+            exit(1);
+        }
+        close(tty);
+    }
+
     enableRawTerminalMode();
     initEditor();
-    if (argc >= 2) {
-        editorOpen(argv[1]);
+    editorMeasureWindow();
+    E.fps = fps;
+    E.max_lines = max_lines > 0 ? max_lines : 0;
+    E.memory_budget = budget << 20;
+    if (trigram) {
+        E.trigram = 1;
+        E.trigram_table = calloc(TRIGRAM_BUCKETS, sizeof(trigramPosting));
+    }
+
+    if (stream_fd != -1) {
+        editorFollow(stream_fd, 0);
+    } else if (filename && follow) {
+        editorOpenFollow(filename);
+    } else if (filename) {
+        editorOpen(filename);
     }
+    // Further files are read once switched to
+    for (int i = 0; i < more_count; i++)
+        editorAddBuffer(more_files[i]);
+    free(more_files);
 
     editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find");
+    editorRun();
+    return 0;
+}
 
+void editorRun() {
     while(1) {
         editorRefreshScreen();
+        if (!editorInputPending(editorIdleWork() ? 0 : -1)) continue;
         editorProcessKeypress();
+
+        // Drain whatever input is already queued and keep accepting keys until
+        // the next frame is due, so rendering never falls behind typing.
+        while (editorInputPending(editorFrameDelay())) {
+            editorProcessKeypress();
+        }
     }
-    
-    return 0;
 }
 
 /*** Terminal ***/
@@ -258,10 +1019,34 @@ void disableRawTerminalMode() {
 }
 
 void editorUpdateSyntax(editorRow* row) {
-    row->highlight = realloc(row->highlight, row->render_size);
-    memset(row->highlight, HIGHLIGHT_NORMAL, row->render_size);
+    editorInvalidateRows(row->index, 1);
+
+    if (editorRowStripped(row)) {
+        editorRowThaw(row);
+        return;
+    }
+
+    if (row->text->render_stale) {
+        editorRowRender(row);
+        return;
+    }
+
+    if (E.syntax == NULL) {
+        editorRowSetHighlight(row, NULL);
+        return;
+    }
+
+    // Rows loaded through the open cache take their comment state from it
+    // and are highlighted once they are read
+    if (E.highlight_deferred) {
+        row->highlight_open_comment = (E.open_cache[row->index / 8] >> (row->index % 8)) & 1;
+        row->highlight_stale = 1;
+        return;
+    }
+    row->highlight_stale = 0;
 
-    if (E.syntax == NULL) return;
+    unsigned char* hl = editorHighlightScratch(row->text->render_size);
+    memset(hl, HIGHLIGHT_NORMAL, row->text->render_size);
 
     char** keywords = E.syntax->keywords;
     char* single_comment_start = E.syntax->single_comment_start;
@@ -276,22 +1061,22 @@ void editorUpdateSyntax(editorRow* row) {
     int in_string = 0;
     int in_comment = (row->index > 0 && E.row[row->index - 1].highlight_open_comment);
 
-    for (int i = 0; i < row->render_size; i++) {
-        char c = row->render_line[i];
-        unsigned char prev_highlight = (i > 0) ? row->highlight[i-1] : HIGHLIGHT_NORMAL;
+    for (int i = 0; i < row->text->render_size; i++) {
+        char c = row->text->render_line[i];
+        unsigned char prev_highlight = (i > 0) ? hl[i-1] : HIGHLIGHT_NORMAL;
 
         if (scs_length && !in_string && !in_comment) {
-            if (!strncmp(&row->render_line[i], single_comment_start, scs_length)) {
-                memset(&row->highlight[i], HIGHLIGHT_COMMENT, row->render_size - i);
+            if (!strncmp(&row->text->render_line[i], single_comment_start, scs_length)) {
+                memset(&hl[i], HIGHLIGHT_COMMENT, row->text->render_size - i);
                 break;
             }
         }
         
         if (mcs_length && mce_length && !in_string) {
             if (in_comment) {
-                row->highlight[i] = HIGHLIGHT_MULTILINE_COMMENT;
-                if (!strncmp(&row->render_line[i], multiline_comment_end, mce_length)) {
-                    memset(&row->highlight[i], HIGHLIGHT_MULTILINE_COMMENT, mce_length);
+                hl[i] = HIGHLIGHT_MULTILINE_COMMENT;
+                if (!strncmp(&row->text->render_line[i], multiline_comment_end, mce_length)) {
+                    memset(&hl[i], HIGHLIGHT_MULTILINE_COMMENT, mce_length);
                     i += mce_length - 1;
                     in_comment = 0;
                     prev_separation = 1;
@@ -300,8 +1085,8 @@ void editorUpdateSyntax(editorRow* row) {
                     continue;
                 }
                 continue;
-            } else if (!strncmp(&row->render_line[i], multiline_comment_start, mcs_length)) {
-                memset(&row->highlight[i], HIGHLIGHT_MULTILINE_COMMENT, mcs_length);
+            } else if (!strncmp(&row->text->render_line[i], multiline_comment_start, mcs_length)) {
+                memset(&hl[i], HIGHLIGHT_MULTILINE_COMMENT, mcs_length);
                 i += mcs_length - 1;
                 in_comment = 1;
                 continue;
@@ -310,10 +1095,10 @@ void editorUpdateSyntax(editorRow* row) {
 
         if (E.syntax->flags & HIGHLIGHT_STRINGS) {
             if (in_string) {
-                row->highlight[i] = HIGHLIGHT_STRING;
+                hl[i] = HIGHLIGHT_STRING;
                 
-                if (c == '\\' && i + 1 == row->render_size) {
-                    row->render_line[i + 1] = HIGHLIGHT_STRING;
+                if (c == '\\' && i + 1 < row->text->render_size) {
+                    hl[i + 1] = HIGHLIGHT_STRING;
                     i++;
                     continue;
                 }
@@ -324,7 +1109,7 @@ void editorUpdateSyntax(editorRow* row) {
             } else {
                 if (c == '"' || c == '\'') {
                     in_string = c;
-                    row->highlight[i] = HIGHLIGHT_STRING;
+                    hl[i] = HIGHLIGHT_STRING;
                     continue;
                 }
             }
@@ -332,7 +1117,7 @@ void editorUpdateSyntax(editorRow* row) {
 
         if (E.syntax->flags & HIGHLIGHT_NUMBERS) {    
             if ((isdigit(c) && (prev_separation || prev_highlight == HIGHLIGHT_NUMBER)) || ((c == '.') && (prev_highlight == HIGHLIGHT_NUMBER))) {
-                row->highlight[i] = HIGHLIGHT_NUMBER;
+                hl[i] = HIGHLIGHT_NUMBER;
                 prev_separation = 0;
                 continue;
             }
@@ -346,8 +1131,8 @@ void editorUpdateSyntax(editorRow* row) {
                 if (keyword2)
                     keyword_length--;
 
-                if (!strncmp(&row->render_line[i], keywords[j], keyword_length) && isSeparator(row->render_line[i + keyword_length])) {
-                    memset(&row->highlight[i], keyword2 ? HIGHLIGHT_KEYWORD2 : HIGHLIGHT_KEYWORD1, keyword_length);
+                if (!strncmp(&row->text->render_line[i], keywords[j], keyword_length) && isSeparator(row->text->render_line[i + keyword_length])) {
+                    memset(&hl[i], keyword2 ? HIGHLIGHT_KEYWORD2 : HIGHLIGHT_KEYWORD1, keyword_length);
                     i += keyword_length;
                     break;
                 }
@@ -362,6 +1147,8 @@ void editorUpdateSyntax(editorRow* row) {
         prev_separation = isSeparator(c);
     }
 
+    editorRowSetHighlight(row, hl);
+
     int changed = (row->highlight_open_comment != in_comment);
 
     row->highlight_open_comment = in_comment;
@@ -419,8 +1206,70 @@ int isSeparator(int c) {
     return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
 }
 
+// Per-character highlight work area, shared by every row
+unsigned char* editorHighlightScratch(int size) {
+    static unsigned char* scratch = NULL;
+    static int scratch_size = 0;
+
+    if (size > scratch_size) {
+        scratch_size = size * 2;
+        scratch = realloc(scratch, scratch_size);
+        if (!scratch) die("editorHighlightScratch failed");
+    }
+    return scratch;
+}
+
+// Stores per-character classes as runs; NULL clears the row's highlighting
+void editorRowSetHighlight(editorRow* row, unsigned char* hl) {
+    int spans = 0;
+    for (int i = 0; hl && i < row->text->render_size; i++) {
+        if (hl[i] != HIGHLIGHT_NORMAL && (i == 0 || hl[i] != hl[i - 1]))
+            spans++;
+    }
+
+    if (spans != row->text->highlight_spans) {
+        free(row->text->highlight);
+        row->text->highlight = spans ? malloc(sizeof(highlightSpan) * spans) : NULL;
+        row->text->highlight_spans = spans;
+        editorRowRecount(row);
+    }
+
+    int span = 0;
+    for (int i = 0; span < spans; i++) {
+        if (hl[i] == HIGHLIGHT_NORMAL) continue;
+
+        int j = i;
+        while (j < row->text->render_size && hl[j] == hl[i]) j++;
+        row->text->highlight[span++] = (highlightSpan) { i, j - i, hl[i] };
+        i = j - 1;
+    }
+}
+
+unsigned char* editorRowExpandHighlight(editorRow* row) {
+    unsigned char* hl = editorHighlightScratch(row->text->render_size);
+    memset(hl, HIGHLIGHT_NORMAL, row->text->render_size);
+    for (int i = 0; i < row->text->highlight_spans; i++)
+        memset(&hl[row->text->highlight[i].start], row->text->highlight[i].type, row->text->highlight[i].length);
+    return hl;
+}
+
 /*** Input ***/
+
+// Keys come from the macro being replayed, or from the terminal, in which
+// case they are also appended to the macro being recorded.
 int editorReadKey() {
+    if (E.replaying && E.macro_pos < E.macro_length)
+        return E.macro[E.macro_pos++];
+
+    int c = editorReadTerminalKey();
+    if (E.recording && c != CTRL_KEY('r') && c != CTRL_KEY('p')) {
+        E.macro = realloc(E.macro, sizeof(int) * (E.macro_length + 1));
+        E.macro[E.macro_length++] = c;
+    }
+    return c;
+}
+
+int editorReadTerminalKey() {
     int nread;
     char c = '\0';
     while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
@@ -473,6 +1322,7 @@ int editorReadKey() {
 void editorProcessKeypress() {
     static int quit_times = QUIT_TIMES;
     int c = editorReadKey();
+    if (editorCursorsKeypress(c)) return;
 
     switch (c) {
         case '\r':
@@ -499,10 +1349,55 @@ void editorProcessKeypress() {
             editorFind();
             break;
 
+        case CTRL_KEY('r'):
+            editorToggleRecording();
+            break;
+
+        case CTRL_KEY('p'):
+            editorReplayMacro();
+            break;
+
+        case CTRL_KEY('w'):
+            editorToggleWrap();
+            break;
+
+        case CTRL_KEY('t'):
+            editorToggleFold();
+            break;
+
+        case CTRL_KEY('g'):
+            editorToggleGutter();
+            break;
+
+        case CTRL_KEY('d'):
+            editorShowDiff();
+            break;
+
+        case CTRL_KEY('e'):
+            editorCommand();
+            break;
+
+        case CTRL_KEY('k'):
+            editorToggleBlock();
+            break;
+
+        case CTRL_KEY('o'):
+            editorPromptOpen();
+            break;
+
+        case CTRL_KEY('n'):
+            editorNextBuffer();
+            break;
+
+        case CTRL_KEY(' '):
+            editorComplete();
+            break;
+
         case CTRL_KEY('q'):
-            if (E.dirty && quit_times > 0) {
-                editorSetStatusMessage("WARNING! File has unsaved changes. "
-                                        "Press Ctrl-Q %d more times to quit.", quit_times);
+            if (editorDirtyBuffers() && quit_times > 0) {
+                editorSetStatusMessage("WARNING! %s unsaved changes. "
+                                        "Press Ctrl-Q %d more times to quit.",
+                                        editorDirtyBuffers() > 1 ? "Files have" : "File has", quit_times);
                 quit_times--;
                 return;
             }
@@ -511,10 +1406,10 @@ void editorProcessKeypress() {
             exit(0);
             break;
         case PAGE_UP:
-            E.cursor_y = E.row_offest;
+            E.cursor_y = editorDisplayToRow(E.row_offest);
             break;
         case PAGE_DOWN:
-            E.cursor_y = E.row_offest + E.screen_rows - 1;
+            E.cursor_y = editorDisplayToRow(E.row_offest + E.screen_rows - 1);
             if (E.cursor_y > E.num_rows) E.cursor_y = E.num_rows;
             break;
         case HOME_KEY:
@@ -539,33 +1434,77 @@ void editorProcessKeypress() {
 }
 
 void editorRefreshScreen() {
+    if (E.batch) return;
     editorScroll();
 
     struct append_buffer ab = ABUF_INIT;
 
+    buffer_append(&ab, "\x1b[?2026h", 8);
     buffer_append(&ab, "\x1b[?25l", 6);
-    buffer_append(&ab, "\x1b[H", 3);
-    
-    editorDrawRows(&ab);
+
+    // Only repaint what changed: a pure vertical scroll shifts the old rows
+    // inside a scroll region and draws just the newly exposed ones.
+    int scrolled = E.row_offest - E.drawn_row_offset;
+    if (E.redraw || E.col_offset != E.drawn_col_offset || abs(scrolled) >= E.screen_rows) {
+        editorDrawRows(&ab, 0, E.screen_rows);
+    } else if (scrolled != 0) {
+        char region[32];
+        int region_length = snprintf(region, sizeof(region), "\x1b[1;%dr\x1b[%d%c\x1b[r",
+                                     E.screen_rows, abs(scrolled), scrolled > 0 ? 'S' : 'T');
+        buffer_append(&ab, region, region_length);
+
+        if (scrolled > 0)
+            editorDrawRows(&ab, E.screen_rows - scrolled, E.screen_rows);
+        else
+            editorDrawRows(&ab, 0, -scrolled);
+    }
+    E.drawn_row_offset = E.row_offest;
+    E.drawn_col_offset = E.col_offset;
+    E.drawn_first_row = editorDisplayToRow(E.row_offest);
+    E.drawn_last_row = editorDisplayToRow(E.row_offest + E.screen_rows - 1);
+    E.redraw = 0;
+
+    char buf[32];
+    snprintf(buf, sizeof(buf), "\x1b[%d;1H", E.screen_rows + 1);
+    buffer_append(&ab, buf, strlen(buf));
     editorDrawStatusBar(&ab);
     editorDrawMessageBar(&ab);
     
-    char buf[32];
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", E.cursor_y - E.row_offest + 1, E.render_x - E.col_offset + 1);
+
+    int screen_x = E.render_x - E.col_offset;
+    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", E.render_y - E.row_offest + 1, screen_x + E.gutter + 1);
     buffer_append(&ab, buf, strlen(buf));
 
     buffer_append(&ab, "\x1b[?25h", 6);
+    buffer_append(&ab, "\x1b[?2026l", 8);
 
     write(STDOUT_FILENO, ab.buf, ab.len);
     buffer_free(&ab);
+    E.last_frame = currentTimeMs();
 }
 
-void editorDrawRows(struct append_buffer* ab) {
+// Marks screen content stale when rows [at, at + count) are visible, or when
+// count is negative (rows inserted or deleted at `at` shift everything below).
+void editorInvalidateRows(int at, int count) {
+    if (count < 0) {
+        if (at <= E.drawn_last_row) E.redraw = 1;
+    } else if (at <= E.drawn_last_row && at + count > E.drawn_first_row) {
+        E.redraw = 1;
+    }
+}
+
+void editorDrawRows(struct append_buffer* ab, int first, int last) {
+    char position[16];
+    int position_length = snprintf(position, sizeof(position), "\x1b[%d;1H", first + 1);
+    buffer_append(ab, position, position_length);
+
+    for (int i = first; i < last; i++) {
+        int file_row = editorDisplayToRow(i + E.row_offest);
+        if (E.gutter)
+            editorDrawGutter(ab, file_row, i + E.row_offest == editorRowToDisplay(file_row));
 
-    for (int i = 0; i < E.screen_rows; i++) {
-        int file_row = i + E.row_offest;
         if (file_row >= E.num_rows) {
-            if (i == E.screen_rows / 3 && E.num_rows == 0) {
+            if (i == E.screen_rows / 3 && E.num_rows == 0 && !E.loading) {
                 char welcome[80];
 
                 int welcome_length = snprintf(welcome, sizeof(welcome), "Warm Editor -- version %s", WARM_VERSION);
@@ -586,65 +1525,166 @@ void editorDrawRows(struct append_buffer* ab) {
                 buffer_append(ab, "~", 1);
             }
         } else {
-            int scs_length = E.row[file_row].render_size - E.col_offset;
-            if (scs_length < 0) scs_length = 0;
-            if (scs_length > E.screen_cols) scs_length = E.screen_cols;
-            
-            char* c = &E.row[file_row].render_line[E.col_offset];
-            unsigned char* highlight = &E.row[file_row].highlight[E.col_offset];
+            editorRow* row = &E.row[file_row];
+            editorRowThaw(row);
+            editorRowHighlight(row);
+
+            // Columns [first_column, first_column + screen_cols) map to the
+            // rendered bytes [start, end); a wide character cut by either
+            // edge is left out
+            int first_column = E.col_offset;
+            if (E.wrap)
+                editorRowWrap(row, INT_MAX, i + E.row_offest - editorRowToDisplay(file_row), &first_column);
+            int last_column = first_column + E.screen_cols;
+            int start = editorRowIndexAt(row, first_column);
+            int end = editorRowIndexAt(row, last_column);
+            if (end < start) end = start;
+            if (editorRowColumn(row, end) > last_column) {
+                int column = editorRowColumn(row, end - 1);
+                while (end > start && editorRowColumn(row, end - 1) == column) end--;
+            }
+            if (editorRowColumn(row, start) > first_column) buffer_append(ab, " ", 1);
             int current_color = -1;
-
-            for (int j = 0; j < scs_length; j++) {
-                if (iscntrl(c[j])) {
-                    char symbol = (c[j] <= 26) ? '@' + c[j] : '?';
-                    buffer_append(ab, "\x1b[7m", 4);
-                    buffer_append(ab, &symbol, 1);
-                    buffer_append(ab, "\x1b[m", 3);
-                    if (current_color != -1) {
-                        char buffer[16];
-                        int c_length = snprintf(buffer, sizeof(buffer), "\x1b[%dm", current_color);
-                        buffer_append(ab, buffer, c_length);
-                    }
-                } else if (highlight[j] == HIGHLIGHT_NORMAL) {
-                    if (current_color != -1) {
-                        buffer_append(ab, "\x1b[39m", 5);
-                        current_color = -1;
-                    }
-                    buffer_append(ab, &c[j], 1);
-                } else {
-                    int color = editorSyntaxToColor(highlight[j]);
-                    
-                    if (color != current_color) {
-                        current_color = color;
-                        char buffer[16];
-                        int c_length = snprintf(buffer, sizeof(buffer), "\x1b[%dm", color);
-                        buffer_append(ab, buffer, c_length);
-                    }
-                    
-                    buffer_append(ab, &c[j], 1);
+            int span = 0;
+
+            // The block and extra cursors go over the colors in inverse video
+            int j = start;
+            int mark = 0, mark_from, mark_to, past_end = 0;
+            while ((E.block || E.num_cursors) &&
+                   editorNextMark(file_row, row, &mark, &mark_from, &mark_to)) {
+                if (mark_from >= end) {
+                    past_end = (mark_from == row->text->render_size && end == row->text->render_size);
+                    break;
                 }
+                if (mark_to <= j) continue;
+                if (mark_from < j) mark_from = j;
+                if (mark_to > end) mark_to = end;
+                editorDrawSpans(ab, row, j, mark_from, &span, &current_color);
+                buffer_append(ab, "\x1b[7m", 4);
+                editorDrawSpans(ab, row, mark_from, mark_to, &span, &current_color);
+                buffer_append(ab, "\x1b[27m", 5);
+                j = mark_to;
             }
+            editorDrawSpans(ab, row, j, end, &span, &current_color);
 
             buffer_append(ab, "\x1b[39m", 5);
+            if (past_end && editorRowColumn(row, end) - first_column < E.screen_cols)
+                buffer_append(ab, "\x1b[7m \x1b[27m", 10);
+            int shown = editorRowColumn(row, end) - first_column;
+            if (shown < 0) shown = 0;
+
+            // Folded header: note how many rows follow it, space permitting
+            int fold_rows = editorFoldRows(row->index);
+            if (fold_rows && end == row->text->render_size) {
+                char marker[32];
+                int marker_length = snprintf(marker, sizeof(marker), " ... %d lines ", fold_rows);
+                int room = E.screen_cols - shown - 1;
+                if (marker_length > room) marker_length = room;
+                if (marker_length > 0) {
+                    buffer_append(ab, " \x1b[7m", 5);
+                    buffer_append(ab, marker + 1, marker_length - 1);
+                    buffer_append(ab, "\x1b[m", 3);
+                }
+            }
         }
 
         buffer_append(ab, "\x1b[K", 3);
-        buffer_append(ab, "\r\n", 2);
+        if (i + 1 < last)
+            buffer_append(ab, "\r\n", 2);
+    }
+}
+
+// Walks the highlight runs overlapping rendered bytes [from, to): one color
+// change per run, plain text in between. `span` carries the run reached over
+// consecutive calls on the same row.
+void editorDrawSpans(struct append_buffer *ab, editorRow* row, int from, int to, int* span, int* current_color) {
+    while (*span < row->text->highlight_spans &&
+           row->text->highlight[*span].start + row->text->highlight[*span].length <= from)
+        (*span)++;
+
+    for (int j = from; j < to; ) {
+        if (*span < row->text->highlight_spans && row->text->highlight[*span].start <= j) {
+            int span_end = row->text->highlight[*span].start + row->text->highlight[*span].length;
+            if (span_end > to) span_end = to;
+            editorDrawText(ab, &row->text->render_line[j], span_end - j,
+                           editorSyntaxToColor(row->text->highlight[*span].type), current_color);
+            j = span_end;
+            if (j == row->text->highlight[*span].start + row->text->highlight[*span].length) (*span)++;
+        } else {
+            int text_end = *span < row->text->highlight_spans ? row->text->highlight[*span].start : to;
+            if (text_end > to) text_end = to;
+            editorDrawText(ab, &row->text->render_line[j], text_end - j, -1, current_color);
+            j = text_end;
+        }
+    }
+}
+
+// Appends text in one color, showing control characters and invalid UTF-8
+// in inverse video
+void editorDrawText(struct append_buffer *ab, char* s, int length, int color, int* current_color) {
+    if (length <= 0) return;
+
+    if (color != *current_color) {
+        char buffer[16];
+        int c_length = color == -1 ? snprintf(buffer, sizeof(buffer), "\x1b[39m")
+                                   : snprintf(buffer, sizeof(buffer), "\x1b[%dm", color);
+        buffer_append(ab, buffer, c_length);
+        *current_color = color;
+    }
+
+    int plain = 0;
+    for (int j = 0; j < length; j++) {
+        if (s[j] & 0x80) {
+            int codepoint;
+            int char_length = editorDecodeUtf8(&s[j], length - j, &codepoint);
+            if (char_length) {
+                j += char_length - 1;
+                continue;
+            }
+        } else if (!iscntrl((unsigned char) s[j])) {
+            continue;
+        }
+
+        buffer_append(ab, &s[plain], j - plain);
+        plain = j + 1;
+
+        char symbol = (s[j] >= 0 && s[j] <= 26) ? '@' + s[j] : '?';
+        buffer_append(ab, "\x1b[7m", 4);
+        buffer_append(ab, &symbol, 1);
+        buffer_append(ab, "\x1b[m", 3);
+        if (color != -1) {
+            char buffer[16];
+            int c_length = snprintf(buffer, sizeof(buffer), "\x1b[%dm", color);
+            buffer_append(ab, buffer, c_length);
+        }
     }
+    buffer_append(ab, &s[plain], length - plain);
 }
 
 void editorDrawStatusBar(struct append_buffer *ab) {
     buffer_append(ab, "\x1b[7m", 4);
     char status[80];
     char render_status[80];
+    char loading[24] = "";
+    char buffer[32] = "";
+
+    if (E.num_buffers > 1)
+        snprintf(buffer, sizeof(buffer), "[%d/%d] ", E.current_buffer + 1, E.num_buffers);
+    if (E.loading && E.load_size > 0)
+        snprintf(loading, sizeof(loading), "(loading %d%%) ", (int)(E.load_bytes * 100 / E.load_size));
 
     int scs_length = snprintf(
         status,
         sizeof(status),
-        "%.20s - %d lines %s",
+        "%s%.20s - %d lines %s%s%s%s%s",
+        buffer,
         E.filename ? E.filename : "[No Name]",
-        E.num_rows, 
-        E.dirty ? "(modified)" : ""
+        E.num_rows,
+        loading,
+        E.folded_rows ? "(folds) " : "",
+        E.block ? "(block) " : E.num_cursors ? "(cursors) " : "",
+        E.dirty ? "(modified) " : "",
+        E.recording ? "(recording)" : ""
         );
     
     int render_length = snprintf(
@@ -656,12 +1696,13 @@ void editorDrawStatusBar(struct append_buffer *ab) {
         E.num_rows
         );
 
-    if (scs_length > E.screen_cols)
-        scs_length = E.screen_cols;
+    int width = E.screen_cols + E.gutter;
+    if (scs_length > width)
+        scs_length = width;
     buffer_append(ab, status, scs_length);
 
-    while (scs_length < E.screen_cols) {
-        if (E.screen_cols - scs_length == render_length) {
+    while (scs_length < width) {
+        if (width - scs_length == render_length) {
             buffer_append(ab, render_status, render_length);
             break;
         }
@@ -684,8 +1725,8 @@ void editorDrawMessageBar(struct append_buffer *ab) {
     buffer_append(ab, "\x1b[K", 3);
 
     int message_length = strlen(E.status_message);
-    if (message_length > E.screen_cols)
-        message_length = E.screen_cols; 
+    if (message_length > E.screen_cols + E.gutter)
+        message_length = E.screen_cols + E.gutter;
     if (message_length && time(NULL) - E.status_message_time < 5) {
         buffer_append(ab, E.status_message, message_length);
     }
@@ -734,6 +1775,9 @@ char *editorPrompt(char *prompt, void(*callback)(char*, int)) {
         int c = editorReadKey();
 
         if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE) {
+            // Drops a whole UTF-8 character
+            while (scs_length != 0 && (buffer[scs_length - 1] & 0xC0) == 0x80)
+                scs_length--;
             if (scs_length != 0) {
                 buffer[--scs_length] = '\0';
             }
@@ -759,32 +1803,104 @@ char *editorPrompt(char *prompt, void(*callback)(char*, int)) {
     }
 }
 
+// Waits for a key while servicing file change notifications. Returns 0 when
+// the wait ended without input, e.g. because the buffer was reloaded.
+int editorInputPending(int timeout_ms) {
+    struct pollfd pfd[4];
+    int fds = 0, watch = -1, stream = -1, load = -1;
+
+    pfd[fds++] = (struct pollfd) { STDIN_FILENO, POLLIN, 0 };
+    if (E.watch_fd != -1) {
+        watch = fds;
+        pfd[fds++] = (struct pollfd) { E.watch_fd, POLLIN, 0 };
+    }
+    if (E.stream_fd != -1 && E.stream_poll) {
+        stream = fds;
+        pfd[fds++] = (struct pollfd) { E.stream_fd, POLLIN, 0 };
+    }
+    if (E.loading) {
+        load = fds;
+        pfd[fds++] = (struct pollfd) { E.load_pipe[0], POLLIN, 0 };
+    }
+    if (poll(pfd, fds, timeout_ms) <= 0) return 0;
+
+    if (watch != -1 && (pfd[watch].revents & POLLIN)) {
+        editorHandleFileEvents();
+        return 0;
+    }
+    if (stream != -1 && pfd[stream].revents) {
+        editorReadStream();
+        return 0;
+    }
+    if (load != -1 && pfd[load].revents) {
+        // The loader queued more lines; idle work picks them up
+        char wakeups[64];
+        while (read(E.load_pipe[0], wakeups, sizeof(wakeups)) > 0);
+        return 0;
+    }
+    return (pfd[0].revents & POLLIN) != 0;
+}
+
+int editorKeyWaiting() {
+    struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+    return poll(&pfd, 1, 0) > 0;
+}
+
+// Runs background work until the next frame is due or a key arrives.
+// Returns 1 if anything was done, so the screen is refreshed before the main
+// loop goes back to sleeping on input.
+int editorIdleWork() {
+    int more = 0;
+    int worked = 0;
+    do {
+        more = 0;
+        if (E.loading) more |= editorLoadRows();
+        if (E.freeze_pending) more |= editorFreezeColdRows();
+        if (E.trigram) more |= editorTrigramBuild();
+        more |= editorWordsBuild();
+        worked |= more;
+    } while (more && editorFrameDelay() > 0 && !editorKeyWaiting());
+    return worked;
+}
+
+// Milliseconds left before another frame may be drawn
+int editorFrameDelay() {
+    long long delay = E.last_frame + 1000 / E.fps - currentTimeMs();
+    return delay > 0 ? (int)delay : 0;
+}
+
+long long currentTimeMs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 void editorMoveCursor(int key) {
     editorRow* row = (E.cursor_y >= E.num_rows) ? NULL : &E.row[E.cursor_y];
 
     switch (key) {
         case ARROW_UP:
             if (E.cursor_y != 0)
-                E.cursor_y--;
+                E.cursor_y = editorPrevVisibleRow(E.cursor_y);
             break;
         case ARROW_LEFT:
             if (E.cursor_x != 0)
-                E.cursor_x--;
+                E.cursor_x = editorRowPrevChar(row, E.cursor_x);
             else if (E.cursor_y > 0) {
-                E.cursor_y--;
+                E.cursor_y = editorPrevVisibleRow(E.cursor_y);
                 E.cursor_x = E.row[E.cursor_y].size;
             }
             break;
         case ARROW_DOWN:
             if (E.cursor_y < E.num_rows)
-                E.cursor_y++;
+                E.cursor_y = editorNextVisibleRow(E.cursor_y);
             break;
         case ARROW_RIGHT:
             if (row && E.cursor_x < row->size)
-                E.cursor_x++;
+                E.cursor_x = editorRowNextChar(row, E.cursor_x);
             else if (row && E.cursor_x == row->size) {
                 E.cursor_x = 0;
-                E.cursor_y++;
+                E.cursor_y = editorNextVisibleRow(E.cursor_y);
             }
             break;
     }
@@ -795,6 +1911,12 @@ void editorMoveCursor(int key) {
     if (E.cursor_x > row_length) {
         E.cursor_x = row_length;
     }
+    // Don't land inside a multibyte character on another row
+    if (E.cursor_x > 0 && E.cursor_x < row_length) {
+        editorRowThaw(row);
+        while (E.cursor_x > 0 && (row->text->line[E.cursor_x] & 0xC0) == 0x80)
+            E.cursor_x--;
+    }
 }
 
 void editorOpen(char* filename) {
@@ -803,12 +1925,88 @@ void editorOpen(char* filename) {
 
     editorSelectSyntaxHighlight();
 
-    FILE* fp = fopen(filename, "r");
+    int fd = open(filename, O_RDONLY);
     
-    if (!fp) {
-        die("fopen failed");
+    if (fd == -1) {
+        die("open failed");
     }
 
+    // Reading happens on a loader thread; rows are added while idle, so the
+    // first screen shows up as soon as the first chunk is in
+    struct stat st;
+    E.load_size = fstat(fd, &st) == 0 ? st.st_size : 0;
+    E.load_bytes = 0;
+    if (E.load_size > 0) editorReadOpenCache(&st);
+    E.load_fd = fd;
+    E.load_finished = 0;
+    E.load_error = 0;
+    if (pipe2(E.load_pipe, O_NONBLOCK | O_CLOEXEC) == -1) die("pipe failed");
+    pthread_mutex_init(&E.load_lock, NULL);
+    pthread_cond_init(&E.load_space, NULL);
+    E.loading = 1;
+    if (pthread_create(&E.load_thread, NULL, editorLoadFile, NULL) != 0) die("pthread_create failed");
+
+    E.dirty = 0;
+}
+
+// Drops the current file's text so another one can be opened in its place
+void editorCloseFile() {
+    editorClearCursors();
+    editorWordsReset();
+    editorDeleteRows(0, E.num_rows);
+    E.dirty = 0;
+    E.removed_tail = 0;
+    E.disk_changed = 0;
+    E.cursor_x = 0;
+    E.cursor_y = 0;
+    E.row_offest = 0;
+    E.col_offset = 0;
+    E.freeze_next = 0;
+    E.redraw = 1;
+}
+
+// Shows a line of a file, switching to the buffer holding it or opening it
+// in a new one
+void editorOpenAt(char* filename, int line) {
+    if (!editorOpenBuffer(filename)) return;
+
+    E.goto_row = line - 1;
+    editorGotoPending();
+}
+
+// Moves to the row asked for by editorOpenAt once it has been loaded,
+// showing it in the middle of the screen, or back to where a buffer that
+// was read again had been
+void editorGotoPending() {
+    if (E.goto_row < 0 || (E.goto_row >= E.num_rows && E.loading)) return;
+
+    E.cursor_y = E.goto_row < E.num_rows ? E.goto_row : E.num_rows;
+    E.cursor_x = 0;
+    if (E.cursor_y < E.num_rows)
+        E.cursor_x = E.goto_column < E.row[E.cursor_y].size ? E.goto_column : E.row[E.cursor_y].size;
+    E.goto_row = -1;
+    E.goto_column = 0;
+    editorUnfoldRange(E.cursor_y, 1);
+    int top = editorRowToDisplay(E.cursor_y) - E.screen_rows / 2;
+    if (E.goto_offset >= 0 && E.goto_offset <= editorRowToDisplay(E.cursor_y) &&
+        editorRowToDisplay(E.cursor_y) < E.goto_offset + E.screen_rows)
+        top = E.goto_offset;
+    E.row_offest = top > 0 ? top : 0;
+    E.goto_offset = -1;
+    E.redraw = 1;
+}
+
+// Reads a whole file as lines without their line endings. Returns the
+// number of lines, or -1 if the file can't be opened.
+int editorReadLines(char* filename, char*** lines, size_t** lengths) {
+    FILE* fp = fopen(filename, "r");
+    if (!fp) return -1;
+
+    int num_lines = 0;
+    int lines_cap = 0;
+    *lines = NULL;
+    *lengths = NULL;
+
     char* line = NULL;
     size_t line_cap = 0;
     ssize_t line_length;
@@ -817,12 +2015,187 @@ void editorOpen(char* filename) {
         while (line_length > 0 && (line[line_length - 1] == '\n' || line[line_length - 1] == '\r')) {
             line_length--;
         }
-        editorInsertRow(E.num_rows, line, line_length);
+        if (num_lines == lines_cap) {
+            lines_cap = lines_cap ? lines_cap * 2 : 1024;
+            *lines = realloc(*lines, sizeof(char*) * lines_cap);
+            *lengths = realloc(*lengths, sizeof(size_t) * lines_cap);
+        }
+        (*lines)[num_lines] = line;
+        (*lengths)[num_lines] = line_length;
+        num_lines++;
+        line = NULL;
+        line_cap = 0;
     }
-
     free(line);
     fclose(fp);
-    E.dirty = 0;
+    return num_lines;
+}
+
+// Loader thread: reads the file in large blocks and queues the complete
+// lines, carrying a partial last line over to the next block
+void* editorLoadFile(void* arg) {
+    (void) arg;
+    int capacity = LOAD_CHUNK_BYTES;
+    char* buffer = malloc(capacity);
+    int filled = 0;
+    int error = 0;
+    int cancelled = 0;
+
+    while (!cancelled) {
+        if (filled == capacity) {
+            capacity *= 2;
+            buffer = realloc(buffer, capacity);
+        }
+        ssize_t length = read(E.load_fd, &buffer[filled], capacity - filled);
+        if (length == -1 && errno == EINTR) continue;
+        if (length == -1) error = errno;
+        if (length <= 0) break;
+        filled += length;
+
+        char* last = memrchr(buffer, '\n', filled);
+        if (!last) continue;
+
+        int used = last - buffer + 1;
+        char* rest = malloc(capacity);
+        memcpy(rest, &buffer[used], filled - used);
+        cancelled = !editorLoadPush(buffer, used);
+        buffer = rest;
+        filled -= used;
+    }
+
+    // An unterminated last line still becomes a row
+    if (filled > 0 && !cancelled) {
+        if (filled == capacity) buffer = realloc(buffer, capacity + 1);
+        buffer[filled++] = '\n';
+        editorLoadPush(buffer, filled);
+    } else {
+        free(buffer);
+    }
+
+    pthread_mutex_lock(&E.load_lock);
+    E.load_finished = 1;
+    E.load_error = error;
+    pthread_mutex_unlock(&E.load_lock);
+    if (write(E.load_pipe[1], "", 1) == -1) {}
+    return NULL;
+}
+
+// Queues a chunk for the main thread, waiting while it is far behind.
+// Returns 0 if the load was cancelled instead.
+int editorLoadPush(char* data, int length) {
+    loadChunk* chunk = malloc(sizeof(loadChunk));
+    chunk->data = data;
+    chunk->length = length;
+    chunk->next = NULL;
+
+    pthread_mutex_lock(&E.load_lock);
+    while (E.load_queued >= LOAD_QUEUE_CHUNKS && !E.load_cancel)
+        pthread_cond_wait(&E.load_space, &E.load_lock);
+    if (E.load_cancel) {
+        pthread_mutex_unlock(&E.load_lock);
+        free(data);
+        free(chunk);
+        return 0;
+    }
+    if (E.load_tail) E.load_tail->next = chunk;
+    else E.load_head = chunk;
+    E.load_tail = chunk;
+    E.load_queued++;
+    pthread_mutex_unlock(&E.load_lock);
+
+    if (write(E.load_pipe[1], "", 1) == -1) {}
+    return 1;
+}
+
+// Appends up to LOAD_SLICE_ROWS queued lines. Returns whether anything changed.
+int editorLoadRows() {
+    int budget = LOAD_SLICE_ROWS;
+    int dirty = E.dirty;
+    int finished = 0;
+    int done = 0;
+
+    // Edits may have moved rows away from the cached lines
+    if (dirty && E.open_cache) editorDropOpenCache();
+
+    while (budget > 0) {
+        if (!E.load_chunk) {
+            pthread_mutex_lock(&E.load_lock);
+            loadChunk* chunk = E.load_head;
+            if (chunk) {
+                E.load_head = chunk->next;
+                if (!E.load_head) E.load_tail = NULL;
+                E.load_queued--;
+                pthread_cond_signal(&E.load_space);
+            }
+            finished = E.load_finished;
+            pthread_mutex_unlock(&E.load_lock);
+
+            if (!chunk) {
+                done = finished;
+                break;
+            }
+            E.load_chunk = chunk;
+            E.load_offset = 0;
+        }
+
+        loadChunk* chunk = E.load_chunk;
+        while (budget > 0 && E.load_offset < chunk->length) {
+            char* line = &chunk->data[E.load_offset];
+            int line_length = (char*) memchr(line, '\n', chunk->length - E.load_offset) - line;
+            E.load_offset += line_length + 1;
+            E.load_bytes += line_length + 1;
+
+            while (line_length > 0 && line[line_length - 1] == '\r') {
+                line_length--;
+            }
+            E.highlight_deferred = E.open_cache && E.num_rows < E.open_cache_rows;
+            editorInsertRow(E.num_rows, line, line_length);
+            E.highlight_deferred = 0;
+            editorRowMarkSaved(&E.row[E.num_rows - 1]);
+            budget--;
+        }
+
+        if (E.load_offset == chunk->length) {
+            free(chunk->data);
+            free(chunk);
+            E.load_chunk = NULL;
+        }
+    }
+
+    // Loaded rows aren't modifications
+    E.dirty = dirty;
+    if (done) editorFinishLoad();
+    editorGotoPending();
+    return budget < LOAD_SLICE_ROWS || finished;
+}
+
+void editorFinishLoad() {
+    pthread_join(E.load_thread, NULL);
+    pthread_mutex_destroy(&E.load_lock);
+    pthread_cond_destroy(&E.load_space);
+
+    struct stat st;
+    if (E.open_cache) {
+        // The file changed between the stat and the read: cached states
+        // can't be trusted
+        if (E.num_rows != E.open_cache_rows) {
+            for (int j = 0; j < E.num_rows; j++)
+                if (E.row[j].highlight_stale) editorUpdateSyntax(&E.row[j]);
+        }
+        editorDropOpenCache();
+    } else if (!E.load_error && !E.dirty && fstat(E.load_fd, &st) == 0 && st.st_size == E.load_size) {
+        editorWriteOpenCache(&st);
+    }
+    close(E.load_fd);
+    close(E.load_pipe[0]);
+    close(E.load_pipe[1]);
+    E.load_fd = -1;
+    E.loading = 0;
+    E.redraw = 1;
+
+    if (E.load_error) editorSetStatusMessage("Can't read file! I/O error: %s", strerror(E.load_error));
+    editorWatchFile();
+    editorEnforceBudget();
 }
 
 char *editorRowsToString(int *buffer_length) {
@@ -838,7 +2211,7 @@ char *editorRowsToString(int *buffer_length) {
     char* p = buffer;
 
     for (int i = 0; i < E.num_rows; i++) {
-        memcpy(p, E.row[i].line, E.row[i].size);
+        memcpy(p, editorRowLine(&E.row[i]), E.row[i].size);
         p += E.row[i].size;
         *p = '\n';
         p++;
@@ -848,6 +2221,13 @@ char *editorRowsToString(int *buffer_length) {
 }
 
 void editorSave() {
+    static int overwrite_times = 1;
+
+    if (E.loading) {
+        editorSetStatusMessage("Can't save while the file is still loading");
+        return;
+    }
+
     if (E.filename == NULL) {
         E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
         if (E.filename == NULL) {
@@ -855,7 +2235,18 @@ void editorSave() {
             return;
         }
         editorSelectSyntaxHighlight();
+        editorWatchFile();
+    } else if (E.disk_changed || editorDiskStateChanged()) {
+        E.disk_changed = 1;
+        if (overwrite_times > 0) {
+            editorSetStatusMessage("WARNING! File changed on disk. "
+                                    "Press Ctrl-S %d more time to overwrite it.", overwrite_times);
+            overwrite_times--;
+            return;
+        }
     }
+    overwrite_times = 1;
+
     int scs_length;
     char *buffer = editorRowsToString(&scs_length);
 
@@ -866,6 +2257,9 @@ void editorSave() {
             close(fd);
             free(buffer);
             E.dirty = 0;
+            E.disk_changed = 0;
+            editorMarkSaved();
+            editorRecordDiskState();
             editorSetStatusMessage("%d bytes written to disk", scs_length);
             return;
         }
@@ -876,82 +2270,4260 @@ void editorSave() {
     editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
 }
 
-void editorFindCallback(char* query, int key) {
-    static int last_match = -1;
-    static int direction = 1;
 
-    static int saved_highlight_line;
-    static char* saved_highlight = NULL;
+/*** Open Cache ***/
 
-    if (saved_highlight) {
-        memcpy(E.row[saved_highlight_line].highlight, saved_highlight, E.row[saved_highlight_line].render_size);
-        free(saved_highlight);
-        saved_highlight = NULL;
+// $XDG_CACHE_HOME/warm/<hash of the real path>, or NULL
+char* editorOpenCachePath() {
+    char* real = realpath(E.filename, NULL);
+    if (!real) return NULL;
+
+    char* base = getenv("XDG_CACHE_HOME");
+    char* home = getenv("HOME");
+    char* directory = NULL;
+    if (base && *base) {
+        if (asprintf(&directory, "%s/warm", base) == -1) directory = NULL;
+    } else if (home && *home) {
+        if (asprintf(&directory, "%s/.cache/warm", home) == -1) directory = NULL;
     }
 
-    if (key == '\r' || key == '\x1b') {
-        last_match = -1;
-        direction = 1;
-        return;
-    } else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
-        direction = 1;
-    } else if (key == ARROW_LEFT || key == ARROW_UP) {
-        direction = -1;
-    } else {
-        last_match = -1;
-        direction = 1;
+    char* path = NULL;
+    if (directory && asprintf(&path, "%s/%016llx", directory,
+                              editorHashLine(real, strlen(real))) == -1)
+        path = NULL;
+    free(directory);
+    free(real);
+    return path;
+}
+
+// Loads the comment states saved by an earlier open of the same, unchanged
+// file, so loading can skip highlighting rows nobody has looked at yet
+void editorReadOpenCache(struct stat* st) {
+    if (E.syntax == NULL || E.syntax->multiline_comment_start == NULL) return;
+
+    char* path = editorOpenCachePath();
+    FILE* fp = path ? fopen(path, "r") : NULL;
+    free(path);
+    if (!fp) return;
+
+    openCacheHeader header;
+    char* real = realpath(E.filename, NULL);
+    char* cached_path = NULL;
+    if (fread(&header, sizeof(header), 1, fp) == 1 && !memcmp(header.magic, OPEN_CACHE_MAGIC, 8) &&
+        header.size == (unsigned long long) st->st_size && header.inode == (unsigned long long) st->st_ino &&
+        header.mtime_sec == st->st_mtim.tv_sec && header.mtime_nsec == st->st_mtim.tv_nsec &&
+        !strncmp(header.filetype, E.syntax->filetype, sizeof(header.filetype)) &&
+        header.rows > 0 && real && header.path_length == (int) strlen(real)) {
+        cached_path = malloc(header.path_length + 1);
+        unsigned char* bits = malloc(header.rows / 8 + 1);
+        if (fread(cached_path, header.path_length, 1, fp) == 1 &&
+            !memcmp(cached_path, real, header.path_length) &&
+            fread(bits, header.rows / 8 + 1, 1, fp) == 1) {
+            E.open_cache = bits;
+            E.open_cache_rows = header.rows;
+        } else {
+            free(bits);
+        }
     }
+    free(cached_path);
+    free(real);
+    fclose(fp);
+}
 
+void editorWriteOpenCache(struct stat* st) {
+    if (E.syntax == NULL || E.syntax->multiline_comment_start == NULL ||
+        E.num_rows < OPEN_CACHE_MIN_ROWS) return;
 
-    if (last_match == -1) {
-        direction = 1;
+    char* path = editorOpenCachePath();
+    char* real = realpath(E.filename, NULL);
+    if (!path || !real) {
+        free(path);
+        free(real);
+        return;
     }
 
-    int current_row = last_match;
+    char* slash = strrchr(path, '/');
+    *slash = '\0';
+    char* parent = strrchr(path, '/');
+    *parent = '\0';
+    mkdir(path, 0700);
+    *parent = '/';
+    mkdir(path, 0700);
+    *slash = '/';
+
+    openCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, OPEN_CACHE_MAGIC, 8);
+    header.size = st->st_size;
+    header.inode = st->st_ino;
+    header.mtime_sec = st->st_mtim.tv_sec;
+    header.mtime_nsec = st->st_mtim.tv_nsec;
+    header.rows = E.num_rows;
+    header.path_length = strlen(real);
+    strncpy(header.filetype, E.syntax->filetype, sizeof(header.filetype) - 1);
+
+    unsigned char* bits = calloc(E.num_rows / 8 + 1, 1);
+    for (int j = 0; j < E.num_rows; j++)
+        if (E.row[j].highlight_open_comment) bits[j / 8] |= 1 << (j % 8);
+
+    // Written aside and renamed into place, so readers never see half a file
+    char* temporary;
+    if (asprintf(&temporary, "%s.%d", path, (int) getpid()) != -1) {
+        FILE* fp = fopen(temporary, "w");
+        int ok = fp && fwrite(&header, sizeof(header), 1, fp) == 1 &&
+                 fwrite(real, header.path_length, 1, fp) == 1 &&
+                 fwrite(bits, E.num_rows / 8 + 1, 1, fp) == 1;
+        if (fp && fclose(fp) != 0) ok = 0;
+        if (!ok || rename(temporary, path) == -1) unlink(temporary);
+        free(temporary);
+    }
+    free(bits);
+    free(real);
+    free(path);
+}
 
-    for (int i = 0; i < E.num_rows; i++) {
-        current_row += direction;
-        if (current_row == -1) {
-            current_row = E.num_rows - 1;
-        } else if (current_row == E.num_rows) {
-            current_row = 0;
-        }
-        
-        editorRow* row = &E.row[current_row];
-        char* match = strstr(row->render_line, query);
+// Stops deferring: rows loaded so far keep their cached comment states,
+// which are right for the text on disk
+void editorDropOpenCache() {
+    free(E.open_cache);
+    E.open_cache = NULL;
+    E.open_cache_rows = 0;
+}
 
-        if (match) {
-            last_match = current_row;
-            E.cursor_y = current_row;
-            E.cursor_x = editorRenderxToCursorx(row, match - row->render_line);
-            E.row_offest = E.num_rows;
+/*** File Watching ***/
+
+// Watches the directory holding E.filename, so that files replaced by
+// rename (the way most tools rewrite files) are noticed too.
+void editorWatchFile() {
+    if (E.watch_fd == -1) {
+        E.watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (E.watch_fd == -1) return;
+    }
+    if (E.watch_wd != -1) {
+        inotify_rm_watch(E.watch_fd, E.watch_wd);
+        E.watch_wd = -1;
+    }
+
+    char* slash = strrchr(E.filename, '/');
+    char* directory = slash ? strndup(E.filename, slash - E.filename + 1) : strdup(".");
+    free(E.watch_name);
+    E.watch_name = strdup(slash ? slash + 1 : E.filename);
+
+    E.watch_wd = inotify_add_watch(E.watch_fd, directory, IN_CLOSE_WRITE | IN_MOVED_TO);
+    free(directory);
+    editorRecordDiskState();
+}
+
+void editorRecordDiskState() {
+    if (stat(E.filename, &E.disk_state) == -1)
+        memset(&E.disk_state, 0, sizeof(E.disk_state));
+}
+
+int editorDiskStateChanged() {
+    struct stat st;
+    if (stat(E.filename, &st) == -1) return 0;
+
+    return st.st_ino != E.disk_state.st_ino || st.st_size != E.disk_state.st_size ||
+           st.st_mtim.tv_sec != E.disk_state.st_mtim.tv_sec ||
+           st.st_mtim.tv_nsec != E.disk_state.st_mtim.tv_nsec;
+}
+
+void editorHandleFileEvents() {
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int touched = 0;
+    ssize_t length;
+
+    while ((length = read(E.watch_fd, events, sizeof(events))) > 0) {
+        for (char* p = events; p < events + length; ) {
+            struct inotify_event* event = (struct inotify_event*) p;
+            if (event->len && E.watch_name && !strcmp(event->name, E.watch_name))
+                touched = 1;
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+
+    // A followed file is watched directly, its events carry no name
+    if (E.stream_fd != -1 && !E.stream_poll) {
+        editorReadStream();
+        return;
+    }
+
+    // Our own saves show up here too; they already updated E.disk_state.
+    if (!touched || !editorDiskStateChanged()) return;
+
+    if (E.dirty) {
+        E.disk_changed = 1;
+        editorSetStatusMessage("WARNING! %.20s changed on disk while you have unsaved changes", E.watch_name);
+    } else {
+        editorReloadFromDisk();
+    }
+}
+
+// Re-reads the file and replaces only the rows between the unchanged prefix
+// and suffix, so just the edited region gets re-rendered and re-highlighted.
+void editorReloadFromDisk() {
+    char** lines;
+    size_t* lengths;
+    int num_lines = editorReadLines(E.filename, &lines, &lengths);
+    if (num_lines == -1) return;
+    editorRecordDiskState();
+
+    int prefix = 0;
+    while (prefix < E.num_rows && prefix < num_lines &&
+           (size_t)E.row[prefix].size == lengths[prefix] &&
+           !memcmp(editorRowLine(&E.row[prefix]), lines[prefix], lengths[prefix])) {
+        prefix++;
+    }
+
+    int suffix = 0;
+    while (suffix < E.num_rows - prefix && suffix < num_lines - prefix) {
+        editorRow* row = &E.row[E.num_rows - 1 - suffix];
+        int j = num_lines - 1 - suffix;
+        if ((size_t)row->size != lengths[j] || memcmp(editorRowLine(row), lines[j], lengths[j])) break;
+        suffix++;
+    }
+
+    int changed = E.num_rows - prefix - suffix;
+    int inserted = num_lines - prefix - suffix;
+
+    editorDeleteRows(prefix, changed);
+    for (int j = 0; j < inserted; j++) {
+        editorInsertRow(prefix + j, lines[prefix + j], lengths[prefix + j]);
+    }
+    if (prefix + inserted < E.num_rows)
+        editorUpdateSyntax(&E.row[prefix + inserted]);
+
+    for (int j = 0; j < num_lines; j++) free(lines[j]);
+    free(lines);
+    free(lengths);
+
+    E.dirty = 0;
+    E.disk_changed = 0;
+    editorMarkSaved();
+    if (E.cursor_y > E.num_rows) E.cursor_y = E.num_rows;
+    if (E.cursor_y < E.num_rows && E.cursor_x > E.row[E.cursor_y].size)
+        E.cursor_x = E.row[E.cursor_y].size;
+
+    if (changed || inserted)
+        editorSetStatusMessage("Reloaded %.20s: %d lines changed on disk", E.watch_name, changed > inserted ? changed : inserted);
+}
+
+void editorOpenFollow(char* filename) {
+    free(E.filename);
+    E.filename = strdup(filename);
+    editorSelectSyntaxHighlight();
+
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) die("open failed");
+
+    E.watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (E.watch_fd != -1)
+        E.watch_wd = inotify_add_watch(E.watch_fd, filename, IN_MODIFY);
+
+    editorFollow(fd, 1);
+}
+
+// Appends everything readable from fd as rows, now and whenever more
+// arrives. Pipes are polled directly, followed files through inotify; the
+// end of a pipe, or of a file that isn't followed, ends the input.
+void editorFollow(int fd, int follow) {
+    struct stat st;
+    E.stream_fd = fd;
+    E.stream_poll = (fstat(fd, &st) == 0 && !S_ISREG(st.st_mode));
+    E.stream_follow = follow && !E.stream_poll;
+    E.stream_provisional = 0;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    editorReadStream();
+}
+
+void editorReadStream() {
+    char buffer[65536];
+    ssize_t length;
+
+    // A file truncated in place (logrotate's copytruncate) is read again
+    // from its start
+    struct stat st;
+    if (E.stream_follow && fstat(E.stream_fd, &st) == 0 &&
+        st.st_size < lseek(E.stream_fd, 0, SEEK_CUR)) {
+        lseek(E.stream_fd, 0, SEEK_SET);
+        editorCloseFile();
+        E.stream_provisional = 0;
+        editorSetStatusMessage("%.30s was truncated, reading it again", E.filename);
+    }
+
+    while ((length = read(E.stream_fd, buffer, sizeof(buffer))) > 0) {
+        editorAppendStreamRows(buffer, length);
+    }
+
+    if (length == 0 && !E.stream_follow) {
+        // The writer closed the pipe, or the file ended; an unterminated
+        // last line stays as it is
+        if (E.stream_provisional)
+            editorAppendStreamRows("\n", 1);
+        close(E.stream_fd);
+        E.stream_fd = -1;
+        editorSetStatusMessage("End of input");
+    }
+}
+
+// Turns lines into rows. An unterminated last line is shown as a provisional
+// row that the rest of the line is appended to. The cursor stays pinned to
+// the last row unless the user moved away from it, and with --max-lines the
+// oldest rows are dropped in one batch so memory stays bounded.
+void editorAppendStreamRows(char* data, int length) {
+    int dirty = E.dirty;
+    int pinned = E.num_rows == 0 || E.cursor_y >= E.num_rows - 1;
+
+    char* end = data + length;
+    while (data < end) {
+        char* newline = memchr(data, '\n', end - data);
+        int line_length = (newline ? newline : end) - data;
+
+        // Rows deleted meanwhile took the provisional one with them
+        if (E.stream_provisional && E.num_rows) {
+            editorRow* row = &E.row[E.num_rows - 1];
+            editorRowAppendString(row, data, line_length);
+            if (newline) {
+                int trailing = 0;
+                while (trailing < row->size && row->text->line[row->size - 1 - trailing] == '\r')
+                    trailing++;
+                if (trailing) editorRowDeleteChar(row, row->size - trailing, trailing);
+            }
+        } else {
+            int trimmed = line_length;
+            while (newline && trimmed > 0 && data[trimmed - 1] == '\r')
+                trimmed--;
+            editorInsertRow(E.num_rows, data, trimmed);
+        }
+        editorRowMarkSaved(&E.row[E.num_rows - 1]);
+        E.stream_provisional = !newline;
+        data = newline ? newline + 1 : end;
+    }
+
+    if (E.max_lines && E.num_rows > E.max_lines) {
+        int dropped = E.num_rows - E.max_lines;
+        int dropped_lines = editorRowToDisplay(dropped);
+        int redraw = E.redraw;
+
+        editorDeleteRows(0, dropped);
+
+        // Rows above the screen went away; the visible ones did not change
+        if (dropped <= E.drawn_first_row) {
+            E.redraw = redraw;
+            E.drawn_row_offset -= dropped_lines;
+            E.drawn_first_row -= dropped;
+            E.drawn_last_row -= dropped;
+        }
+        if (E.num_rows) E.row[0].removed_before = 0;
+        if (E.num_rows && E.syntax)
+            editorUpdateSyntax(&E.row[0]);
+        E.row_offest = E.row_offest > dropped_lines ? E.row_offest - dropped_lines : 0;
+        E.cursor_y = E.cursor_y > dropped ? E.cursor_y - dropped : 0;
+    }
+
+    if (pinned && E.num_rows) {
+        E.cursor_y = E.num_rows - 1;
+        E.cursor_x = 0;
+    }
+    E.dirty = dirty;
+}
+
+// Where the search started; replayed searches go forward from there
+static int find_from_y = 0;
+static int find_from_x = 0;
+
+void editorFindCallback(char* query, int key) {
+    static int last_match = -1;
+    static int direction = 1;
+
+    static int saved_highlight_line;
+    static int saved_highlight_spans;
+    static highlightSpan* saved_highlight = NULL;
+
+    if (saved_highlight) {
+        editorRow* row = &E.row[saved_highlight_line];
+        editorInvalidateRows(saved_highlight_line, 1);
+        free(row->text->highlight);
+        row->text->highlight = saved_highlight;
+        row->text->highlight_spans = saved_highlight_spans;
+        editorRowRecount(row);
+        saved_highlight = NULL;
+    }
+
+    if (key == '\r' || key == '\x1b') {
+        last_match = -1;
+        direction = 1;
+        return;
+    } else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
+        direction = 1;
+    } else if (key == ARROW_LEFT || key == ARROW_UP) {
+        direction = -1;
+    } else {
+        last_match = -1;
+        direction = 1;
+    }
+
+
+    if (last_match == -1) {
+        direction = 1;
+    }
+
+    int current_row = last_match;
+    E.search_failed = 1;
+
+    // Replayed macros don't wrap around, so replaying until a search fails
+    // stops after the last match instead of going round forever. They start
+    // past the cursor, on its own row.
+    int wrap = !E.replaying;
+    int from_row = -1, from = 0;
+    if (E.replaying && last_match == -1 && find_from_y < E.num_rows) {
+        editorRow* row = &E.row[find_from_y];
+        editorRowThaw(row);
+        for (int j = 0; j < find_from_x && j < row->size; j++)
+            from += row->text->line[j] == '\t' ? TAB_SIZE - from % TAB_SIZE : 1;
+        from_row = find_from_y;
+        current_row = find_from_y - 1;
+        from++;
+    }
+
+    int indexed = editorTrigramReady(query);
+    for (int i = 0; i <= E.num_rows; i++) {
+        int candidate = indexed ? editorTrigramFind(query, current_row, direction) : -2;
+        if (candidate == -1) break;
+        if (candidate != -2) {
+            if (!wrap && (candidate - current_row) * direction <= 0) break;
+            current_row = candidate;
+        } else {
+            indexed = 0;
+            current_row += direction;
+            if (current_row == -1 || current_row == E.num_rows) {
+                if (!wrap) break;
+                current_row = current_row == -1 ? E.num_rows - 1 : 0;
+            }
+            if (!editorRowContains(&E.row[current_row], query)) continue;
+        }
+
+        editorRow* row = &E.row[current_row];
+        editorRowThaw(row);
+        editorRowHighlight(row);
+        char* start = row->text->render_line;
+        if (current_row == from_row) start += from < row->text->render_size ? from : row->text->render_size;
+        char* match = strstr(start, query);
+
+        if (match) {
+            editorUnfoldRange(current_row, 1);
+            last_match = current_row;
+            E.search_failed = 0;
+            E.cursor_y = current_row;
+            E.cursor_x = editorRenderxToCursorx(row, match - row->text->render_line);
+            E.row_offest = editorDisplayLines();
 
             saved_highlight_line = current_row;
-            saved_highlight = malloc(row->render_size);
-            memcpy(saved_highlight,row->highlight, row->render_size);
-            memset(&row->highlight[match - row->render_line], HIGHLIGHT_MATCH, strlen(query));
+            saved_highlight_spans = row->text->highlight_spans;
+            saved_highlight = malloc(sizeof(highlightSpan) * (saved_highlight_spans + 1));
+            memcpy(saved_highlight, row->text->highlight, sizeof(highlightSpan) * saved_highlight_spans);
+
+            unsigned char* hl = editorRowExpandHighlight(row);
+            memset(&hl[match - row->text->render_line], HIGHLIGHT_MATCH, strlen(query));
+            editorRowSetHighlight(row, hl);
+            editorInvalidateRows(current_row, 1);
             break;
         }
     }
 }
 
-void editorFind() {
-    int saved_x = E.cursor_x;
-    int saved_y = E.cursor_y;
-    int saved_col_offset = E.col_offset;
-    int saved_row_offset = E.row_offest;
-    
-    char* query = editorPrompt("Search: %s (Use ESC/Arrows/Enter)", editorFindCallback);
-    
-    if (query)
-        free(query);
-    
-    if (!query) {
-        E.cursor_x = saved_x;
-        E.cursor_y = saved_y;
-        E.col_offset = saved_col_offset;
-        E.row_offest = saved_row_offset;
+void editorFind() {
+    int saved_x = E.cursor_x;
+    int saved_y = E.cursor_y;
+    int saved_col_offset = E.col_offset;
+    int saved_row_offset = E.row_offest;
+    find_from_y = E.cursor_y;
+    find_from_x = E.cursor_x;
+    
+    char* query = editorPrompt("Search: %s (Use ESC/Arrows/Enter)", editorFindCallback);
+    
+    if (query)
+        free(query);
+    
+    if (!query) {
+        E.cursor_x = saved_x;
+        E.cursor_y = saved_y;
+        E.col_offset = saved_col_offset;
+        E.row_offest = saved_row_offset;
+    }
+}
+
+/*** UTF-8 ***/
+
+// Most rows are plain ASCII and keep the byte-per-column layout; test eight
+// bytes at a time for a set high bit to find the ones that don't
+int editorIsAscii(const char* s, int length) {
+    int j = 0;
+    for (; j + 8 <= length; j += 8) {
+        unsigned long long word;
+        memcpy(&word, &s[j], 8);
+        if (word & 0x8080808080808080ULL) return 0;
+    }
+    for (; j < length; j++) {
+        if (s[j] & 0x80) return 0;
+    }
+    return 1;
+}
+
+// Returns the length of the character at s, or 0 for bytes that aren't valid
+// UTF-8 (including overlong forms, surrogates and C1 controls), which are
+// shown one column each as '?'
+int editorDecodeUtf8(const char* s, int length, int* codepoint) {
+    const unsigned char* u = (const unsigned char*) s;
+    if (u[0] < 0x80) {
+        *codepoint = u[0];
+        return 1;
+    }
+
+    int count;
+    int value;
+    unsigned char low = 0x80, high = 0xBF;
+    if (u[0] >= 0xC2 && u[0] <= 0xDF) {
+        count = 2;
+        value = u[0] & 0x1F;
+    } else if (u[0] >= 0xE0 && u[0] <= 0xEF) {
+        count = 3;
+        value = u[0] & 0x0F;
+        if (u[0] == 0xE0) low = 0xA0;
+        if (u[0] == 0xED) high = 0x9F;
+    } else if (u[0] >= 0xF0 && u[0] <= 0xF4) {
+        count = 4;
+        value = u[0] & 0x07;
+        if (u[0] == 0xF0) low = 0x90;
+        if (u[0] == 0xF4) high = 0x8F;
+    } else {
+        return 0;
+    }
+    if (count > length) return 0;
+
+    for (int j = 1; j < count; j++) {
+        if (u[j] < low || u[j] > high) return 0;
+        value = (value << 6) | (u[j] & 0x3F);
+        low = 0x80;
+        high = 0xBF;
+    }
+    if (value < 0xA0) return 0;
+
+    *codepoint = value;
+    return count;
+}
+
+// Combining marks and zero-width characters take no column, East Asian wide
+// and fullwidth characters (and emoji) take two
+int editorCharWidth(int codepoint) {
+    static const int ranges[][3] = {
+        { 0x0300, 0x036F, 0 }, { 0x0483, 0x0489, 0 }, { 0x0591, 0x05BD, 0 },
+        { 0x0610, 0x061A, 0 }, { 0x064B, 0x065F, 0 }, { 0x0E31, 0x0E31, 0 },
+        { 0x0E34, 0x0E3A, 0 }, { 0x0E47, 0x0E4E, 0 }, { 0x1100, 0x115F, 2 },
+        { 0x1AB0, 0x1AFF, 0 }, { 0x1DC0, 0x1DFF, 0 }, { 0x200B, 0x200F, 0 },
+        { 0x20D0, 0x20FF, 0 }, { 0x231A, 0x231B, 2 }, { 0x2329, 0x232A, 2 },
+        { 0x23E9, 0x23EC, 2 }, { 0x25FD, 0x25FE, 2 }, { 0x2614, 0x2615, 2 },
+        { 0x26AA, 0x26AB, 2 }, { 0x26BD, 0x26BE, 2 }, { 0x26FD, 0x26FD, 2 },
+        { 0x2705, 0x2705, 2 }, { 0x274C, 0x274C, 2 }, { 0x2753, 0x2755, 2 },
+        { 0x2795, 0x2797, 2 }, { 0x2B1B, 0x2B1C, 2 }, { 0x2E80, 0x303E, 2 },
+        { 0x3041, 0x3096, 2 }, { 0x3099, 0x309A, 0 }, { 0x309B, 0x33FF, 2 },
+        { 0x3400, 0x4DBF, 2 }, { 0x4E00, 0xA4CF, 2 }, { 0xA960, 0xA97F, 2 },
+        { 0xAC00, 0xD7A3, 2 }, { 0xF900, 0xFAFF, 2 }, { 0xFE00, 0xFE0F, 0 },
+        { 0xFE10, 0xFE19, 2 }, { 0xFE20, 0xFE2F, 0 }, { 0xFE30, 0xFE6F, 2 },
+        { 0xFEFF, 0xFEFF, 0 }, { 0xFF00, 0xFF60, 2 }, { 0xFFE0, 0xFFE6, 2 },
+        { 0x16FE0, 0x16FE4, 2 }, { 0x17000, 0x18CFF, 2 }, { 0x1B000, 0x1B2FF, 2 },
+        { 0x1F004, 0x1F004, 2 }, { 0x1F0CF, 0x1F0CF, 2 }, { 0x1F18E, 0x1F18E, 2 },
+        { 0x1F191, 0x1F19A, 2 }, { 0x1F200, 0x1F251, 2 }, { 0x1F300, 0x1F64F, 2 },
+        { 0x1F680, 0x1F6FF, 2 }, { 0x1F7E0, 0x1F7EB, 2 }, { 0x1F900, 0x1F9FF, 2 },
+        { 0x1FA70, 0x1FAFF, 2 }, { 0x20000, 0x3FFFD, 2 }, { 0xE0001, 0xE007F, 0 },
+        { 0xE0100, 0xE01EF, 0 },
+    };
+    if (codepoint < 0x0300) return 1;
+
+    int low = 0, high = sizeof(ranges) / sizeof(ranges[0]) - 1;
+    while (low <= high) {
+        int middle = (low + high) / 2;
+        if (codepoint < ranges[middle][0]) high = middle - 1;
+        else if (codepoint > ranges[middle][1]) low = middle + 1;
+        else return ranges[middle][2];
+    }
+    return 1;
+}
+
+// Marks the characters of a row that aren't one byte in one column; between
+// them every byte takes a column. Plain ASCII rows have no marks.
+void editorRowMeasure(editorRow* row) {
+    free(row->text->columns);
+    row->text->columns = NULL;
+    row->text->column_marks = 0;
+    row->render_width = row->text->render_size;
+    if (editorIsAscii(row->text->line, row->size)) return;
+
+    int cap = 0;
+    int column = 0;
+    for (int j = 0; j < row->text->render_size; ) {
+        int codepoint;
+        int length = editorDecodeUtf8(&row->text->render_line[j], row->text->render_size - j, &codepoint);
+        int width = length ? editorCharWidth(codepoint) : 1;
+        if (!length) length = 1;
+
+        if (length != 1 || width != 1) {
+            if (row->text->column_marks == cap) {
+                cap = cap ? cap * 2 : 4;
+                row->text->columns = realloc(row->text->columns, sizeof(columnMark) * cap);
+            }
+            columnMark* mark = &row->text->columns[row->text->column_marks++];
+            mark->offset = j;
+            mark->column = column;
+            mark->length = length;
+            mark->width = width;
+        }
+        column += width;
+        j += length;
+    }
+    if (row->text->column_marks && row->text->column_marks < cap)
+        row->text->columns = realloc(row->text->columns, sizeof(columnMark) * row->text->column_marks);
+    row->render_width = column;
+}
+
+// Display column of a rendered byte
+int editorRowColumn(editorRow* row, int at) {
+    if (!row->text->columns) return at;
+
+    // Last mark at or before the byte
+    int low = 0, high = row->text->column_marks;
+    while (low < high) {
+        int middle = (low + high) / 2;
+        if (row->text->columns[middle].offset <= at) low = middle + 1;
+        else high = middle;
+    }
+    if (low == 0) return at;
+
+    columnMark* mark = &row->text->columns[low - 1];
+    if (at < mark->offset + mark->length) return mark->column;
+    return mark->column + mark->width + at - mark->offset - mark->length;
+}
+
+// First rendered byte at or past a display column
+int editorRowIndexAt(editorRow* row, int column) {
+    int at = column;
+    if (row->text->columns) {
+        // Last mark left of the column
+        int low = 0, high = row->text->column_marks;
+        while (low < high) {
+            int middle = (low + high) / 2;
+            if (row->text->columns[middle].column < column) low = middle + 1;
+            else high = middle;
+        }
+        if (low > 0) {
+            columnMark* mark = &row->text->columns[low - 1];
+            int after = mark->column + mark->width;
+            at = mark->offset + mark->length + (column > after ? column - after : 0);
+        }
+    }
+    return at < row->text->render_size ? at : row->text->render_size;
+}
+
+// Lays a row out in screen-wide lines, moving characters that would straddle
+// the edge to the next line. Stops at `column` or at the start of display
+// line `line`, whichever comes first, and returns the display line reached
+// along with the column it starts at.
+int editorRowWrap(editorRow* row, int column, int line, int* line_start) {
+    int width = E.screen_cols;
+    if (!row->text || !row->text->columns) {
+        int current = column / width < line ? column / width : line;
+        if (line_start) *line_start = current * width;
+        return current;
+    }
+
+    int current = 0;
+    int start = 0;
+    int at = 0;
+    for (int j = 0; current < line; ) {
+        int length = 1;
+        int char_width = 1;
+        if (j < row->text->render_size) {
+            int codepoint;
+            length = editorDecodeUtf8(&row->text->render_line[j], row->text->render_size - j, &codepoint);
+            char_width = length ? editorCharWidth(codepoint) : 1;
+            if (!length) length = 1;
+        }
+        if (at > start && at + char_width - start > width) {
+            current++;
+            start = at;
+        }
+        if (at >= column || j >= row->text->render_size) break;
+        j += length;
+        at += char_width;
+    }
+    if (line_start) *line_start = start;
+    return current;
+}
+
+// Display lines of a row: up to the one its last character starts on, so a
+// row exactly as wide as the screen takes one
+int editorRowWrapLines(editorRow* row) {
+    if (row->render_width == 0) return 1;
+    // Cold rows are laid out a byte to a column until they are thawed
+    int last = row->text ? editorRowColumn(row, row->text->render_size - 1) : row->render_width - 1;
+    return editorRowWrap(row, last, INT_MAX, NULL) + 1;
+}
+
+// The cursor steps over whole characters, along with any zero-width marks
+// combined with them
+int editorRowNextChar(editorRow* row, int at) {
+    if (at >= row->size) return row->size;
+    editorRowThaw(row);
+
+    int codepoint;
+    int length = editorDecodeUtf8(&row->text->line[at], row->size - at, &codepoint);
+    at += length ? length : 1;
+    while (at < row->size) {
+        length = editorDecodeUtf8(&row->text->line[at], row->size - at, &codepoint);
+        if (!length || editorCharWidth(codepoint) != 0) break;
+        at += length;
+    }
+    return at;
+}
+
+int editorRowPrevChar(editorRow* row, int at) {
+    editorRowThaw(row);
+    while (at > 0) {
+        int start = at - 1;
+        while (start > 0 && at - start < 4 && (row->text->line[start] & 0xC0) == 0x80)
+            start--;
+
+        int codepoint;
+        if (editorDecodeUtf8(&row->text->line[start], at - start, &codepoint) != at - start)
+            return at - 1;
+        at = start;
+        if (editorCharWidth(codepoint) != 0) break;
+    }
+    return at;
+}
+
+/*** Display Index ***/
+
+// Whether display lines differ from rows, because of wrapping or folds
+int editorDisplayMapped() {
+    return E.wrap || E.folds;
+}
+
+int editorRowDisplayLines(editorRow* row) {
+    if (row->hidden) return 0;
+    return E.wrap ? row->wrap_lines : 1;
+}
+
+// Fenwick tree over the display lines of each row, so rows and display lines
+// map onto each other in O(log n). Inserting or deleting rows in the middle
+// marks it stale and it is rebuilt in O(n) on the next query; rewrapping,
+// folding or appending rows updates it in place.
+void editorRebuildDisplayIndex() {
+    if (E.display_tree_cap < E.num_rows + 1) {
+        E.display_tree_cap = E.num_rows + 1 + E.num_rows / 2;
+        E.display_tree = realloc(E.display_tree, sizeof(int) * E.display_tree_cap);
+    }
+
+    E.display_tree[0] = 0;
+    for (int i = 1; i <= E.num_rows; i++)
+        E.display_tree[i] = editorRowDisplayLines(&E.row[i - 1]);
+    for (int i = 1; i <= E.num_rows; i++) {
+        int parent = i + (i & -i);
+        if (parent <= E.num_rows)
+            E.display_tree[parent] += E.display_tree[i];
+    }
+
+    E.display_tree_size = E.num_rows;
+    E.display_tree_stale = 0;
+}
+
+// Adds delta display lines to row `at`; at == size appends a new row
+void editorDisplayIndexAdd(int at, int delta) {
+    if (!editorDisplayMapped() || E.display_tree_stale) return;
+
+    if (at == E.display_tree_size) {
+        if (E.display_tree_cap < at + 2) {
+            E.display_tree_cap = (at + 2) * 2;
+            E.display_tree = realloc(E.display_tree, sizeof(int) * E.display_tree_cap);
+        }
+        int i = at + 1;
+        E.display_tree[i] = delta;
+        E.display_tree_size++;
+        for (int j = i - 1; j > i - (i & -i); j -= j & -j)
+            E.display_tree[i] += E.display_tree[j];
+        return;
+    }
+
+    for (int i = at + 1; i <= E.display_tree_size; i += i & -i)
+        E.display_tree[i] += delta;
+}
+
+// First display line of row `at`
+int editorRowToDisplay(int at) {
+    if (!editorDisplayMapped()) return at;
+    if (E.display_tree_stale) editorRebuildDisplayIndex();
+    if (at > E.display_tree_size) at = E.display_tree_size;
+
+    int line = 0;
+    for (int i = at; i > 0; i -= i & -i)
+        line += E.display_tree[i];
+    return line;
+}
+
+// Row shown on display line `line`, or num_rows past the end of the file
+int editorDisplayToRow(int line) {
+    if (!editorDisplayMapped()) return line;
+    if (E.display_tree_stale) editorRebuildDisplayIndex();
+
+    int at = 0;
+    int step = 1;
+    while (step * 2 <= E.display_tree_size) step *= 2;
+
+    for (; step; step /= 2) {
+        if (at + step <= E.display_tree_size && E.display_tree[at + step] <= line) {
+            at += step;
+            line -= E.display_tree[at];
+        }
+    }
+    return at;
+}
+
+int editorDisplayLines() {
+    return editorRowToDisplay(E.num_rows);
+}
+
+// Recounts every row's wrapped lines after the text width changed
+void editorRewrapRows() {
+    // Cold rows keep their width but not their column cache; they are laid
+    // out exactly once thawed
+    for (int j = 0; j < E.num_rows; j++)
+        E.row[j].wrap_lines = editorRowWrapLines(&E.row[j]);
+    E.display_tree_stale = 1;
+}
+
+void editorToggleWrap() {
+    int top_row = editorDisplayToRow(E.row_offest);
+
+    E.wrap = !E.wrap;
+    E.display_tree_stale = 1;
+    E.row_offest = editorRowToDisplay(top_row);
+    E.col_offset = 0;
+    E.redraw = 1;
+    editorSetStatusMessage(E.wrap ? "Soft wrap on" : "Soft wrap off");
+}
+
+// Neighbouring rows that are not hidden in a fold, found in O(log n)
+int editorPrevVisibleRow(int at) {
+    if (at <= 0) return 0;
+    return editorDisplayToRow(editorRowToDisplay(at) - 1);
+}
+
+int editorNextVisibleRow(int at) {
+    if (at >= E.num_rows) return E.num_rows;
+    return editorDisplayToRow(editorRowToDisplay(at + 1));
+}
+
+/*** Folding ***/
+
+// Net count of braces that are not inside strings or comments
+int editorRowBraceDepth(editorRow* row) {
+    editorRowThaw(row);
+    editorRowHighlight(row);
+
+    int depth = 0;
+    int span = 0;
+    for (int i = 0; i < row->text->render_size; i++) {
+        while (span < row->text->highlight_spans &&
+               row->text->highlight[span].start + row->text->highlight[span].length <= i)
+            span++;
+        if (span < row->text->highlight_spans && row->text->highlight[span].start <= i) continue;
+
+        if (row->text->render_line[i] == '{') depth++;
+        else if (row->text->render_line[i] == '}') depth--;
+    }
+    return depth;
+}
+
+// Leading whitespace in columns, -1 for a blank row
+int editorRowIndent(editorRow* row) {
+    editorRowThaw(row);
+    editorRowRender(row);
+
+    int i = 0;
+    while (i < row->text->render_size && row->text->render_line[i] == ' ') i++;
+    return i == row->text->render_size ? -1 : i;
+}
+
+// Last row of the block opened by row `at`: up to the matching closing brace
+// when the row opens one, otherwise the following rows indented deeper
+int editorFoldEnd(int at) {
+    int depth = editorRowBraceDepth(&E.row[at]);
+    if (depth > 0) {
+        int end;
+        for (end = at + 1; end < E.num_rows; end++) {
+            depth += editorRowBraceDepth(&E.row[end]);
+            if (depth <= 0) break;
+        }
+        return end < E.num_rows ? end : E.num_rows - 1;
+    }
+
+    int indent = editorRowIndent(&E.row[at]);
+    int end = at;
+    if (indent == -1) return at;
+    for (int j = at + 1; j < E.num_rows; j++) {
+        int row_indent = editorRowIndent(&E.row[j]);
+        if (row_indent == -1) continue;
+        if (row_indent <= indent) break;
+        end = j;
+    }
+    return end;
+}
+
+// Index of the first fold whose header is at or after row `at`; the folds
+// are kept in E.fold_ranges sorted by header
+int editorFoldSearch(int at) {
+    int low = 0, high = E.folds;
+    while (low < high) {
+        int middle = (low + high) / 2;
+        if (E.fold_ranges[middle].header < at) low = middle + 1;
+        else high = middle;
+    }
+    return low;
+}
+
+// Rows hidden by the fold headed by row `at`, 0 when it heads none
+int editorFoldRows(int at) {
+    int k = editorFoldSearch(at);
+    return k < E.folds && E.fold_ranges[k].header == at ? E.fold_ranges[k].rows : 0;
+}
+
+// Folds nest: a row stays hidden while any fold covers it, and the display
+// index gives those rows no lines, so drawing and moving skip them in O(log n)
+void editorFoldHideRow(int at) {
+    editorRow* row = &E.row[at];
+    if (row->hidden == 0) {
+        editorDisplayIndexAdd(at, -editorRowDisplayLines(row));
+        E.folded_rows++;
+    }
+    row->hidden++;
+}
+
+void editorFoldShowRow(int at) {
+    editorRow* row = &E.row[at];
+    if (--row->hidden == 0) {
+        editorDisplayIndexAdd(at, editorRowDisplayLines(row));
+        E.folded_rows--;
+    }
+}
+
+void editorFoldListInsert(int header, int rows) {
+    if (E.folds == E.folds_cap) {
+        E.folds_cap = E.folds_cap ? E.folds_cap * 2 : 8;
+        E.fold_ranges = realloc(E.fold_ranges, sizeof(foldRange) * E.folds_cap);
+    }
+    int k = editorFoldSearch(header);
+    memmove(&E.fold_ranges[k + 1], &E.fold_ranges[k], sizeof(foldRange) * (E.folds - k));
+    E.fold_ranges[k].header = header;
+    E.fold_ranges[k].rows = rows;
+    E.folds++;
+}
+
+void editorFoldListRemove(int k) {
+    memmove(&E.fold_ranges[k], &E.fold_ranges[k + 1], sizeof(foldRange) * (E.folds - k - 1));
+    E.folds--;
+}
+
+// Listed first: the display index only follows hidden rows while there are folds
+void editorFold(int at, int end) {
+    editorFoldListInsert(at, end - at);
+    for (int j = at + 1; j <= end; j++)
+        editorFoldHideRow(j);
+    E.redraw = 1;
+}
+
+void editorUnfold(int at) {
+    int k = editorFoldSearch(at);
+    if (k == E.folds || E.fold_ranges[k].header != at) return;
+
+    int end = at + E.fold_ranges[k].rows;
+    for (int j = at + 1; j <= end; j++)
+        editorFoldShowRow(j);
+    editorFoldListRemove(k);
+    E.redraw = 1;
+}
+
+// Opens every fold that starts in or covers rows [at, at + count)
+void editorUnfoldRange(int at, int count) {
+    for (int k = editorFoldSearch(at + count) - 1; k >= 0; k--) {
+        if (E.fold_ranges[k].header + E.fold_ranges[k].rows >= at)
+            editorUnfold(E.fold_ranges[k].header);
+    }
+}
+
+// A row is being inserted at `at`: folds after it move down and folds around
+// it take it in. Returns how many folds hide it.
+int editorFoldsInsertRow(int at) {
+    int hidden = 0;
+    for (int k = 0; k < E.folds; k++) {
+        foldRange* fold = &E.fold_ranges[k];
+        if (fold->header >= at) {
+            fold->header++;
+        } else if (fold->header + fold->rows >= at) {
+            fold->rows++;
+            hidden++;
+        }
+    }
+    return hidden;
+}
+
+// Rows [at, at + count) are about to be deleted: folds lose the ones they
+// hid, and a fold losing its header shows the rest of its rows
+void editorFoldsDropRows(int at, int count) {
+    int end = at + count;
+    for (int j = at; j < end && E.folded_rows; j++)
+        if (E.row[j].hidden) E.folded_rows--;
+
+    for (int k = E.folds - 1; k >= 0; k--) {
+        foldRange* fold = &E.fold_ranges[k];
+        int last = fold->header + fold->rows;
+        if (fold->header >= end) {
+            fold->header -= count;
+        } else if (fold->header >= at) {
+            for (int j = end; j <= last; j++)
+                editorFoldShowRow(j);
+            editorFoldListRemove(k);
+        } else if (last >= at) {
+            fold->rows -= (last < end ? last + 1 : end) - at;
+            if (fold->rows == 0) editorFoldListRemove(k);
+        }
+    }
+}
+
+// The same for the rows marked in drop, scattered anywhere
+void editorFoldsDropMarked(char* drop) {
+    // Kept rows before each row, which is where the rows left will be
+    int* kept = malloc(sizeof(int) * (E.num_rows + 1));
+    kept[0] = 0;
+    for (int j = 0; j < E.num_rows; j++) {
+        kept[j + 1] = kept[j] + !drop[j];
+        if (drop[j] && E.row[j].hidden) E.folded_rows--;
+    }
+
+    for (int k = E.folds - 1; k >= 0; k--) {
+        foldRange* fold = &E.fold_ranges[k];
+        int last = fold->header + fold->rows;
+        if (drop[fold->header]) {
+            for (int j = fold->header + 1; j <= last; j++)
+                if (!drop[j]) editorFoldShowRow(j);
+            editorFoldListRemove(k);
+            continue;
+        }
+        fold->rows = kept[last + 1] - kept[fold->header + 1];
+        fold->header = kept[fold->header];
+        if (fold->rows == 0) editorFoldListRemove(k);
+    }
+    free(kept);
+}
+
+void editorToggleFold() {
+    if (E.cursor_y >= E.num_rows) return;
+    int top_row = editorDisplayToRow(E.row_offest);
+
+    if (editorFoldRows(E.cursor_y)) {
+        editorUnfold(E.cursor_y);
+    } else {
+        int end = editorFoldEnd(E.cursor_y);
+        if (end == E.cursor_y) {
+            editorSetStatusMessage("Nothing to fold here");
+            return;
+        }
+        editorFold(E.cursor_y, end);
+    }
+
+    E.row_offest = editorRowToDisplay(top_row);
+}
+
+/*** Cold Rows ***/
+
+// A tiny LZ77 codec. A token byte below 0x80 is followed by token + 1
+// literal bytes; otherwise it is a match of (token & 0x7f) + 4 bytes at the
+// 16 bit little endian distance that follows.
+int coldCompress(const char* src, int length, char* dst) {
+    static int table[4096];
+    int out = 0;
+    int literals = 0;
+    int i = 0;
+
+    for (int j = 0; j < 4096; j++) table[j] = -1;
+
+    while (i < length) {
+        int match_length = 0;
+        int distance = 0;
+
+        if (i + 4 <= length) {
+            unsigned int key;
+            memcpy(&key, &src[i], 4);
+            int slot = (key * 2654435761u) >> 20;
+            int candidate = table[slot];
+            table[slot] = i;
+
+            if (candidate != -1 && i - candidate <= 0xffff && !memcmp(&src[candidate], &src[i], 4)) {
+                distance = i - candidate;
+                match_length = 4;
+                while (i + match_length < length && match_length < 0x7f + 4 &&
+                       src[candidate + match_length] == src[i + match_length])
+                    match_length++;
+            }
+        }
+
+        if (match_length == 0) {
+            if (literals == 0) out++;
+            dst[out++] = src[i++];
+            literals++;
+            if (literals == 0x80) {
+                dst[out - literals - 1] = literals - 1;
+                literals = 0;
+            }
+            continue;
+        }
+
+        if (literals) {
+            dst[out - literals - 1] = literals - 1;
+            literals = 0;
+        }
+        dst[out++] = 0x80 | (match_length - 4);
+        dst[out++] = distance & 0xff;
+        dst[out++] = distance >> 8;
+        i += match_length;
+    }
+
+    if (literals)
+        dst[out - literals - 1] = literals - 1;
+    return out;
+}
+
+void coldDecompress(const char* src, int length, char* dst) {
+    int in = 0;
+    int out = 0;
+
+    while (in < length) {
+        unsigned char token = src[in++];
+        if (token < 0x80) {
+            memcpy(&dst[out], &src[in], token + 1);
+            in += token + 1;
+            out += token + 1;
+        } else {
+            int distance = (unsigned char) src[in] | ((unsigned char) src[in + 1] << 8);
+            in += 2;
+            for (int j = 0; j < (token & 0x7f) + 4; j++, out++)
+                dst[out] = dst[out - distance];
+        }
+    }
+}
+
+// Decompressed text of a block. Only the last block used is kept around,
+// which is enough for sequential passes like saving or searching.
+static coldBlock* cold_cached_block = NULL;
+static char* cold_cached_data = NULL;
+
+char* editorColdBlockData(coldBlock* block) {
+    if (block != cold_cached_block) {
+        free(cold_cached_data);
+        cold_cached_data = malloc(block->raw_size);
+        if (!cold_cached_data) die("editorColdBlockData failed");
+        coldDecompress(block->data, block->compressed_size, cold_cached_data);
+        cold_cached_block = block;
+    }
+    return cold_cached_data;
+}
+
+void editorColdRelease(coldBlock* block) {
+    if (--block->rows > 0) return;
+
+    if (block == cold_cached_block) {
+        free(cold_cached_data);
+        cold_cached_data = NULL;
+        cold_cached_block = NULL;
+    }
+    free(block->data);
+    free(block);
+}
+
+// The row's text, without thawing it; valid until another block is read
+char* editorRowLine(editorRow* row) {
+    if (!row->cold) return row->text->line;
+    return &editorColdBlockData(row->cold)[row->cold_offset];
+}
+
+// Cold rows lost their text and rendering, rows of a buffer that was over
+// the memory budget while inactive may have lost just the rendering
+int editorRowStripped(editorRow* row) {
+    return row->cold || (!row->text->render_line && !row->text->render_stale);
+}
+
+void editorRowThaw(editorRow* row) {
+    if (!editorRowStripped(row)) return;
+
+    if (row->cold) {
+        coldBlock* block = row->cold;
+        E.row_bytes -= editorRowBytes(row);
+        row->text = editorNewRowText(&editorColdBlockData(block)[row->cold_offset], row->size);
+        row->cold = NULL;
+        editorColdRelease(block);
+        E.freeze_pending = 1;
+        if (row->words > 0) editorWordsLink(row);
+    }
+
+    // Thawing doesn't change the text, so the row stays indexed
+    int edited_at = row->text->edited_at;
+    int trigrams = row->trigrams;
+    int trigram_version = E.trigram_version;
+    row->trigrams = 0;
+    row->text->render_alias = 0;
+    row->text->render_line = NULL;
+    editorUpdateRow(row);
+    row->text->edited_at = edited_at;
+    row->trigrams = trigrams;
+    E.trigram_version = trigram_version;
+}
+
+// Packs rows [at, at + count) into one compressed block
+void editorFreezeRows(int at, int count) {
+    int raw_size = 0;
+    for (int j = at; j < at + count; j++)
+        raw_size += E.row[j].size + 1;
+
+    char* raw = malloc(raw_size);
+    char* p = raw;
+    for (int j = at; j < at + count; j++) {
+        memcpy(p, E.row[j].text->line, E.row[j].size + 1);
+        p += E.row[j].size + 1;
+    }
+
+    char* compressed = malloc(raw_size + raw_size / 128 + 16);
+    int compressed_size = coldCompress(raw, raw_size, compressed);
+    free(raw);
+
+    // Not worth it for text that barely compresses
+    if (compressed_size > raw_size * 3 / 4) {
+        free(compressed);
+        return;
+    }
+
+    coldBlock* block = malloc(sizeof(coldBlock));
+    block->data = realloc(compressed, compressed_size);
+    block->compressed_size = compressed_size;
+    block->raw_size = raw_size;
+    block->rows = count;
+
+    int offset = 0;
+    for (int j = at; j < at + count; j++) {
+        editorRow* row = &E.row[j];
+        editorFreeRowText(row);
+        row->cold = block;
+        row->cold_offset = offset;
+        offset += row->size + 1;
+        E.row_bytes += editorRowBytes(row);
+    }
+    E.frozen_rows += count;
+}
+
+// Scans a slice of the rows for ones far from the screen and the cursor that
+// were not edited recently, and compresses them in blocks. Returns 1 while
+// the pass over the file is unfinished.
+int editorFreezeColdRows() {
+    if (E.num_rows < COLD_MIN_ROWS) {
+        E.freeze_pending = 0;
+        return 0;
+    }
+    if (E.freeze_next >= E.num_rows) E.freeze_next = 0;
+
+    int top = editorDisplayToRow(E.row_offest);
+    int scan_end = E.freeze_next + COLD_SCAN_ROWS;
+    if (scan_end > E.num_rows) scan_end = E.num_rows;
+
+    int block_start = -1;
+    int block_bytes = 0;
+    int j;
+    for (j = E.freeze_next; j <= scan_end; j++) {
+        int eligible = 0;
+        if (j < scan_end) {
+            editorRow* row = &E.row[j];
+            eligible = !row->cold && !row->text->render_stale &&
+                       abs(j - top) > COLD_DISTANCE && abs(j - E.cursor_y) > COLD_DISTANCE &&
+                       E.edit_generation - row->text->edited_at > COLD_EDIT_AGE;
+        }
+
+        if (eligible && block_start == -1) {
+            block_start = j;
+            block_bytes = 0;
+        }
+        if (block_start != -1 && (!eligible || block_bytes >= COLD_BLOCK_BYTES)) {
+            editorFreezeRows(block_start, j - block_start);
+            block_start = eligible ? j : -1;
+            block_bytes = 0;
+        }
+        if (eligible) block_bytes += E.row[j].size + 1;
+    }
+
+    E.freeze_next = scan_end;
+    if (scan_end < E.num_rows) return 1;
+
+    E.freeze_next = 0;
+    E.freeze_pending = 0;
+
+#ifdef __GLIBC__
+    // Hand the pages freed by this pass back to the system
+    if (E.frozen_rows) malloc_trim(0);
+#endif
+    E.frozen_rows = 0;
+    return 0;
+}
+
+
+/*** Trigram Index ***/
+
+int editorTrigramBucket(unsigned char a, unsigned char b, unsigned char c) {
+    unsigned int key = (a << 16) | (b << 8) | c;
+    return (key * 2654435761u) >> (32 - TRIGRAM_BITS);
+}
+
+// Posts the row's id under every trigram of its rendered text. Tabs are
+// expanded on the fly so cold rows are indexed without thawing them.
+void editorTrigramAddRow(editorRow* row) {
+    char* line = editorRowLine(row);
+    unsigned char window[3] = { 0 };
+    int filled = 0;
+    int column = 0;
+
+    for (int j = 0; j < row->size; j++) {
+        int spaces = 1;
+        unsigned char c = line[j];
+        if (c == '\t') {
+            c = ' ';
+            spaces = TAB_SIZE - column % TAB_SIZE;
+        }
+
+        for (int k = 0; k < spaces; k++, column++) {
+            window[0] = window[1];
+            window[1] = window[2];
+            window[2] = c;
+            if (++filled < 3) continue;
+
+            trigramPosting* posting = &E.trigram_table[editorTrigramBucket(window[0], window[1], window[2])];
+            if (posting->size && posting->ids[posting->size - 1] == row->id) continue;
+            if (posting->size == posting->cap) {
+                posting->cap = posting->cap ? posting->cap * 2 : 4;
+                posting->ids = realloc(posting->ids, sizeof(int) * posting->cap);
+            }
+            posting->ids[posting->size++] = row->id;
+            row->trigrams++;
+        }
+    }
+    // Rows too short for a trigram still count as indexed
+    if (row->trigrams == 0) row->trigrams = -1;
+    E.trigram_postings += row->trigrams > 0 ? row->trigrams : 0;
+}
+
+// Rows waiting to be (re)indexed; searches check them directly meanwhile
+void editorTrigramQueue(int id) {
+    if (E.trigram_pending_count == E.trigram_pending_cap) {
+        E.trigram_pending_cap = E.trigram_pending_cap ? E.trigram_pending_cap * 2 : 64;
+        E.trigram_pending = realloc(E.trigram_pending, sizeof(int) * E.trigram_pending_cap);
+    }
+    E.trigram_pending[E.trigram_pending_count++] = id;
+}
+
+// Gives an inserted row an id; rows before the initial build position are
+// queued, the build reaches the rest by itself
+void editorTrigramNewRow(editorRow* row) {
+    if (!E.trigram) return;
+
+    if (E.id_count == E.id_cap) {
+        E.id_cap = E.id_cap ? E.id_cap * 2 : 1024;
+        E.id_rows = realloc(E.id_rows, sizeof(int) * E.id_cap);
+        E.id_hits = realloc(E.id_hits, E.id_cap);
+        memset(&E.id_hits[E.id_count], 0, E.id_cap - E.id_count);
+    }
+    row->id = E.id_count++;
+    E.id_rows[row->id] = row->index;
+    E.trigram_version++;
+
+    if (row->index < E.trigram_next) {
+        E.trigram_next++;
+        editorTrigramQueue(row->id);
+    }
+}
+
+// The row's text changed: its old postings become garbage and it is
+// searched directly until it is indexed again
+void editorTrigramForget(editorRow* row) {
+    if (!E.trigram) return;
+    E.trigram_version++;
+    if (row->trigrams == 0) return;
+
+    E.trigram_garbage += row->trigrams > 0 ? row->trigrams : 0;
+    row->trigrams = 0;
+    editorTrigramQueue(row->id);
+}
+
+void editorTrigramDrop(editorRow* row) {
+    if (!E.trigram) return;
+
+    E.trigram_garbage += row->trigrams > 0 ? row->trigrams : 0;
+    E.id_rows[row->id] = -1;
+    E.trigram_version++;
+}
+
+// Starts over with dense ids, dropping postings of deleted and edited rows
+void editorTrigramRebuild() {
+    for (int b = 0; b < TRIGRAM_BUCKETS; b++) {
+        free(E.trigram_table[b].ids);
+        E.trigram_table[b].ids = NULL;
+        E.trigram_table[b].size = E.trigram_table[b].cap = 0;
+    }
+
+    if (E.num_rows > E.id_cap) {
+        E.id_cap = E.num_rows;
+        E.id_rows = realloc(E.id_rows, sizeof(int) * E.id_cap);
+        E.id_hits = realloc(E.id_hits, E.id_cap);
+    }
+    memset(E.id_hits, 0, E.id_cap);
+    for (int j = 0; j < E.num_rows; j++) {
+        E.row[j].id = j;
+        E.row[j].trigrams = 0;
+        E.id_rows[j] = j;
+    }
+    E.id_count = E.num_rows;
+    E.trigram_pending_count = 0;
+    E.trigram_next = 0;
+    E.trigram_postings = 0;
+    E.trigram_garbage = 0;
+    E.trigram_version++;
+}
+
+// Gives back the whole index of an unloaded buffer, table included; it is
+// allocated again and rebuilt when the buffer is read back
+void editorTrigramFree() {
+    editorTrigramRebuild();
+    free(E.trigram_table);
+    free(E.id_rows);
+    free(E.id_hits);
+    free(E.trigram_pending);
+    free(E.trigram_query);
+    free(E.trigram_candidates);
+    E.trigram_table = NULL;
+    E.id_rows = NULL;
+    E.id_hits = NULL;
+    E.trigram_pending = NULL;
+    E.trigram_query = NULL;
+    E.trigram_candidates = NULL;
+    E.id_count = E.id_cap = 0;
+    E.trigram_pending_cap = 0;
+    E.trigram_candidate_count = 0;
+    E.trigram_candidates_version = -1;
+}
+
+// Indexes a slice of rows while idle: queued edits first, then the rows the
+// initial build hasn't reached. Returns whether work is left.
+int editorTrigramBuild() {
+    if (E.trigram_garbage > 1024 * 1024 && E.trigram_garbage > E.trigram_postings)
+        editorTrigramRebuild();
+
+    int budget = TRIGRAM_SCAN_ROWS;
+    while (budget > 0 && E.trigram_pending_count > 0) {
+        int at = E.id_rows[E.trigram_pending[--E.trigram_pending_count]];
+        if (at == -1 || E.row[at].trigrams) continue;
+        editorTrigramAddRow(&E.row[at]);
+        budget--;
+    }
+
+    while (budget > 0 && E.trigram_next < E.num_rows) {
+        editorRow* row = &E.row[E.trigram_next++];
+        if (row->trigrams) continue;
+        editorTrigramAddRow(row);
+        budget--;
+    }
+
+    return E.trigram_pending_count > 0 || E.trigram_next < E.num_rows;
+}
+
+// The index answers queries of three or more characters once every row has
+// been through it; rows edited since are checked directly
+int editorTrigramReady(char* query) {
+    return E.trigram && E.trigram_next == E.num_rows && strlen(query) >= 3;
+}
+
+int editorRowContains(editorRow* row, char* query) {
+    // Tab-free rows that lost their rendering render as their line: search
+    // them in place
+    if (editorRowStripped(row) && row->text->render_alias) return strstr(editorRowLine(row), query) != NULL;
+    editorRowThaw(row);
+    editorRowRender(row);
+    return strstr(row->text->render_line, query) != NULL;
+}
+
+int compareInts(const void* a, const void* b) {
+    return (*(int*)a > *(int*)b) - (*(int*)a < *(int*)b);
+}
+
+// Next row after last_match in direction containing query, wrapping around,
+// or -1. Candidates are the rows posted under all of the query's selective
+// trigrams, kept sorted until the query or the text changes. Returns -2 when
+// even the rarest trigram is so common that a plain scan is cheaper.
+int editorTrigramFind(char* query, int last_match, int direction) {
+    if (!E.trigram_query || strcmp(E.trigram_query, query) ||
+        E.trigram_candidates_version != E.trigram_version) {
+        trigramPosting* shortest = NULL;
+        for (int j = 0; query[j + 2]; j++) {
+            trigramPosting* posting = &E.trigram_table[editorTrigramBucket(query[j], query[j + 1], query[j + 2])];
+            if (!shortest || posting->size < shortest->size) shortest = posting;
+        }
+        if (shortest->size > E.num_rows / 8) return -2;
+
+        // Intersect: count, per id of the shortest list, the other selective
+        // lists it appears in
+        int rounds = 1;
+        for (int j = 0; j < shortest->size; j++)
+            E.id_hits[shortest->ids[j]] = 1;
+        for (int j = 0; query[j + 2] && rounds < 255; j++) {
+            trigramPosting* posting = &E.trigram_table[editorTrigramBucket(query[j], query[j + 1], query[j + 2])];
+            if (posting == shortest || posting->size > E.num_rows / 8) continue;
+
+            int seen = 0;
+            for (int k = 0; k < j && !seen; k++)
+                seen = posting == &E.trigram_table[editorTrigramBucket(query[k], query[k + 1], query[k + 2])];
+            if (seen) continue;
+
+            for (int k = 0; k < posting->size; k++) {
+                if (E.id_hits[posting->ids[k]] == rounds)
+                    E.id_hits[posting->ids[k]] = rounds + 1;
+            }
+            rounds++;
+        }
+
+        int candidates = shortest->size + E.trigram_pending_count;
+        E.trigram_candidates = realloc(E.trigram_candidates, sizeof(int) * (candidates + 1));
+        E.trigram_candidate_count = 0;
+        for (int j = 0; j < candidates; j++) {
+            int id = j < shortest->size ? shortest->ids[j] : E.trigram_pending[j - shortest->size];
+            int at = E.id_rows[id];
+            if (j < shortest->size) {
+                int hits = E.id_hits[id];
+                E.id_hits[id] = 0;
+                if (hits != rounds) continue;
+            }
+            if (at == -1) continue;
+            // Edited rows keep stale postings until they are indexed again
+            if (j < shortest->size && E.row[at].trigrams == 0) continue;
+            E.trigram_candidates[E.trigram_candidate_count++] = at;
+        }
+
+        // Ids follow row order until rows are inserted, so this is usually sorted
+        int sorted = 1;
+        for (int j = 1; j < E.trigram_candidate_count && sorted; j++)
+            sorted = E.trigram_candidates[j - 1] < E.trigram_candidates[j];
+        if (!sorted)
+            qsort(E.trigram_candidates, E.trigram_candidate_count, sizeof(int), compareInts);
+        int unique = 0;
+        for (int j = 0; j < E.trigram_candidate_count; j++) {
+            if (unique == 0 || E.trigram_candidates[unique - 1] != E.trigram_candidates[j])
+                E.trigram_candidates[unique++] = E.trigram_candidates[j];
+        }
+        E.trigram_candidate_count = unique;
+
+        free(E.trigram_query);
+        E.trigram_query = strdup(query);
+        E.trigram_candidates_version = E.trigram_version;
+    }
+
+    int count = E.trigram_candidate_count;
+    if (count == 0) return -1;
+
+    // First candidate past last_match, by binary search
+    int low = 0, high = count;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (E.trigram_candidates[mid] <= last_match) low = mid + 1;
+        else high = mid;
+    }
+    if (direction == -1) {
+        while (low > 0 && E.trigram_candidates[low - 1] >= last_match) low--;
+        low--;
+    }
+
+    for (int i = 0; i < count; i++) {
+        int at = E.trigram_candidates[((low + i * direction) % count + count) % count];
+        if (editorRowContains(&E.row[at], query)) return at;
+    }
+    return -1;
+}
+
+
+/*** Word Index ***/
+
+// Words are runs of letters, digits, underscores and non-ASCII bytes that
+// don't start with a digit
+int editorIsWordChar(unsigned char c) {
+    return isalnum(c) || c == '_' || c >= 0x80;
+}
+
+// Id of a word, adding it to the table (with no rows yet) if asked to.
+// Returns -1 for unknown words otherwise.
+int editorWordFind(const char* s, int length, int add) {
+    unsigned int hash = (unsigned int) editorHashLine(s, length);
+    if (add && (E.word_count + 1) * 2 > E.word_slot_mask) editorWordsGrow();
+    if (!E.word_slots) return -1;
+
+    int slot = hash & E.word_slot_mask;
+    for (; E.word_slots[slot] != -1; slot = (slot + 1) & E.word_slot_mask) {
+        wordEntry* word = &E.word_table[E.word_slots[slot]];
+        if (word->hash == hash && word->length == length && !memcmp(word->text, s, length))
+            return E.word_slots[slot];
+    }
+    if (!add) return -1;
+
+    if (E.word_count == E.word_cap) {
+        E.word_cap = E.word_cap ? E.word_cap * 2 : 1024;
+        E.word_table = realloc(E.word_table, sizeof(wordEntry) * E.word_cap);
+    }
+    wordEntry* word = &E.word_table[E.word_count];
+    word->text = strndup(s, length);
+    word->length = length;
+    word->rows = 0;
+    word->hash = hash;
+    E.word_slots[slot] = E.word_count;
+    E.word_dead++;
+    return E.word_count++;
+}
+
+// Doubles the hash slots, which are kept at most half full
+void editorWordsGrow() {
+    int size = E.word_slots ? (E.word_slot_mask + 1) * 2 : 2048;
+    free(E.word_slots);
+    E.word_slots = malloc(sizeof(int) * size);
+    memset(E.word_slots, -1, sizeof(int) * size);
+    E.word_slot_mask = size - 1;
+
+    for (int id = 0; id < E.word_count; id++) {
+        int slot = E.word_table[id].hash & E.word_slot_mask;
+        while (E.word_slots[slot] != -1) slot = (slot + 1) & E.word_slot_mask;
+        E.word_slots[slot] = id;
+    }
+}
+
+// Ids of the distinct words of a line, sorted, in a scratch array valid
+// until the next call. Returns how many.
+static int* word_scratch = NULL;
+static int word_scratch_cap = 0;
+
+int editorWordsCollect(const char* line, int size, int add) {
+    int count = 0;
+    for (int j = 0; j < size; ) {
+        if (!editorIsWordChar(line[j])) {
+            j++;
+            continue;
+        }
+        int start = j;
+        while (j < size && editorIsWordChar(line[j])) j++;
+        if (isdigit((unsigned char) line[start]) || j - start < WORD_MIN_LENGTH || j - start > WORD_MAX_LENGTH)
+            continue;
+
+        int id = editorWordFind(&line[start], j - start, add);
+        if (id == -1) continue;
+        if (count == word_scratch_cap) {
+            word_scratch_cap = word_scratch_cap ? word_scratch_cap * 2 : 64;
+            word_scratch = realloc(word_scratch, sizeof(int) * word_scratch_cap);
+        }
+        word_scratch[count++] = id;
+    }
+    if (count < 2) return count;
+
+    // Most lines hold few words, insertion sort beats qsort on them
+    if (count > 32) qsort(word_scratch, count, sizeof(int), compareInts);
+    for (int j = 1; j < count && count <= 32; j++) {
+        int id = word_scratch[j];
+        int k = j;
+        for (; k > 0 && word_scratch[k - 1] > id; k--)
+            word_scratch[k] = word_scratch[k - 1];
+        word_scratch[k] = id;
+    }
+    int distinct = 1;
+    for (int j = 1; j < count; j++) {
+        if (word_scratch[j] != word_scratch[distinct - 1])
+            word_scratch[distinct++] = word_scratch[j];
+    }
+    return distinct;
+}
+
+// Counts the row under each of its words. Cold rows don't keep the list,
+// it is looked up again when they thaw.
+void editorWordsAddRow(editorRow* row) {
+    int count = editorWordsCollect(editorRowLine(row), row->size, 1);
+    for (int j = 0; j < count; j++) {
+        if (E.word_table[word_scratch[j]].rows++ == 0) E.word_dead--;
+    }
+
+    row->words = count ? count : -1;
+    if (row->cold) return;
+    free(row->text->word_ids);
+    row->text->word_ids = NULL;
+    if (count) {
+        row->text->word_ids = malloc(sizeof(int) * count);
+        memcpy(row->text->word_ids, word_scratch, sizeof(int) * count);
+    }
+    editorRowRecount(row);
+}
+
+void editorWordsLink(editorRow* row) {
+    int count = editorWordsCollect(row->text->line, row->size, 0);
+    free(row->text->word_ids);
+    row->text->word_ids = NULL;
+    row->words = count ? count : -1;
+    if (count) {
+        row->text->word_ids = malloc(sizeof(int) * count);
+        memcpy(row->text->word_ids, word_scratch, sizeof(int) * count);
+    }
+    editorRowRecount(row);
+}
+
+// Rows inserted before the initial build position are counted right away by
+// editorUpdateRow, the build reaches the rest by itself
+void editorWordsNewRow(editorRow* row) {
+    if (row->index < E.word_next) E.word_next++;
+}
+
+// The row's text changed: only the words it gained or lost are counted
+void editorWordsUpdate(editorRow* row) {
+    if (row->words == 0) {
+        if (row->index < E.word_next) editorWordsAddRow(row);
+        return;
+    }
+
+    int* old = row->text->word_ids;
+    int old_count = old && row->words > 0 ? row->words : 0;
+    int count = editorWordsCollect(row->text->line, row->size, 1);
+    int i = 0, j = 0;
+    while (i < old_count || j < count) {
+        if (j == count || (i < old_count && old[i] < word_scratch[j])) {
+            if (--E.word_table[old[i++]].rows == 0) E.word_dead++;
+        } else if (i == old_count || old[i] > word_scratch[j]) {
+            if (E.word_table[word_scratch[j++]].rows++ == 0) E.word_dead--;
+        } else {
+            i++;
+            j++;
+        }
+    }
+
+    free(row->text->word_ids);
+    row->text->word_ids = NULL;
+    row->words = count ? count : -1;
+    if (count) {
+        row->text->word_ids = malloc(sizeof(int) * count);
+        memcpy(row->text->word_ids, word_scratch, sizeof(int) * count);
+    }
+    editorRowRecount(row);
+}
+
+void editorWordsDrop(editorRow* row) {
+    if (row->words <= 0) return;
+
+    int* ids = row->text ? row->text->word_ids : NULL;
+    int count = row->words;
+    if (!ids) {
+        count = editorWordsCollect(editorRowLine(row), row->size, 0);
+        ids = word_scratch;
+    }
+    for (int j = 0; j < count; j++) {
+        if (--E.word_table[ids[j]].rows == 0) E.word_dead++;
+    }
+    row->words = 0;
+    if (row->text && row->text->word_ids) {
+        free(row->text->word_ids);
+        row->text->word_ids = NULL;
+        editorRowRecount(row);
+    }
+}
+
+// Forgets every word, before all rows go at once
+void editorWordsReset() {
+    for (int id = 0; id < E.word_count; id++)
+        free(E.word_table[id].text);
+    free(E.word_table);
+    free(E.word_slots);
+    free(E.word_order);
+    E.word_table = NULL;
+    E.word_slots = NULL;
+    E.word_order = NULL;
+    E.word_count = E.word_cap = E.word_slot_mask = 0;
+    E.word_ordered = E.word_dead = 0;
+    E.word_next = 0;
+
+    for (int j = 0; j < E.num_rows; j++) {
+        E.row[j].words = 0;
+        if (E.row[j].text) {
+            free(E.row[j].text->word_ids);
+            E.row[j].text->word_ids = NULL;
+            editorRowRecount(&E.row[j]);
+        }
+    }
+}
+
+int editorWordCompare(const void* a, const void* b) {
+    return strcmp(E.word_table[*(int*)a].text, E.word_table[*(int*)b].text);
+}
+
+// E.word_order lists the ids below E.word_ordered sorted by text; words
+// added since are sorted and merged into it
+void editorWordsMerge() {
+    int added = E.word_count - E.word_ordered;
+    if (added == 0) return;
+
+    int* tail = malloc(sizeof(int) * added);
+    for (int j = 0; j < added; j++)
+        tail[j] = E.word_ordered + j;
+    qsort(tail, added, sizeof(int), editorWordCompare);
+
+    // From the back, each added word finds its place by binary search and
+    // the words sorting after it move up in one block
+    E.word_order = realloc(E.word_order, sizeof(int) * E.word_count);
+    int placed = E.word_count, unplaced = E.word_ordered;
+    for (int j = added - 1; j >= 0; j--) {
+        int low = 0, high = unplaced;
+        while (low < high) {
+            int middle = (low + high) / 2;
+            if (editorWordCompare(&E.word_order[middle], &tail[j]) > 0) high = middle;
+            else low = middle + 1;
+        }
+        placed -= unplaced - low;
+        memmove(&E.word_order[placed], &E.word_order[low], sizeof(int) * (unplaced - low));
+        unplaced = low;
+        E.word_order[--placed] = tail[j];
+    }
+    free(tail);
+    E.word_ordered = E.word_count;
+}
+
+// Drops words no row contains any more, renumbering the rest in order so
+// the rows' sorted lists stay sorted
+void editorWordsCompact() {
+    editorWordsMerge();
+    int* remap = malloc(sizeof(int) * E.word_count);
+    int live = 0;
+    for (int id = 0; id < E.word_count; id++) {
+        if (E.word_table[id].rows == 0) {
+            free(E.word_table[id].text);
+            remap[id] = -1;
+            continue;
+        }
+        E.word_table[live] = E.word_table[id];
+        remap[id] = live++;
+    }
+
+    for (int j = 0; j < E.num_rows; j++) {
+        editorRow* row = &E.row[j];
+        for (int k = 0; row->text && row->text->word_ids && k < row->words; k++)
+            row->text->word_ids[k] = remap[row->text->word_ids[k]];
+    }
+    int kept = 0;
+    for (int k = 0; k < E.word_ordered; k++) {
+        if (remap[E.word_order[k]] != -1) E.word_order[kept++] = remap[E.word_order[k]];
+    }
+    free(remap);
+
+    E.word_count = E.word_ordered = live;
+    E.word_dead = 0;
+    memset(E.word_slots, -1, sizeof(int) * (E.word_slot_mask + 1));
+    for (int id = 0; id < E.word_count; id++) {
+        int slot = E.word_table[id].hash & E.word_slot_mask;
+        while (E.word_slots[slot] != -1) slot = (slot + 1) & E.word_slot_mask;
+        E.word_slots[slot] = id;
+    }
+}
+
+// Counts the words of a slice of rows while idle, once the file is loaded,
+// then keeps the sorted order from falling far behind. Returns whether work
+// is left.
+int editorWordsBuild() {
+    if (E.loading) return 0;
+    if (E.word_dead > WORD_COMPACT_MIN && E.word_dead > E.word_count / 2)
+        editorWordsCompact();
+
+    int budget = WORD_SCAN_ROWS;
+    while (budget > 0 && E.word_next < E.num_rows) {
+        editorRow* row = &E.row[E.word_next++];
+        if (row->words) continue;
+        editorWordsAddRow(row);
+        budget--;
+    }
+
+    // The initial build only merges as the words double
+    int added = E.word_count - E.word_ordered;
+    if (added > WORD_TAIL_MAX && (E.word_next == E.num_rows || added > E.word_ordered)) editorWordsMerge();
+    return E.word_next < E.num_rows;
+}
+
+// Fills ids with up to max words in the text that start with prefix and are
+// longer than it, in alphabetical order. Returns how many.
+int editorWordsComplete(char* prefix, int* ids, int max) {
+    if (E.word_count - E.word_ordered > WORD_TAIL_MAX) editorWordsMerge();
+    int length = strlen(prefix);
+
+    int low = 0, high = E.word_ordered;
+    while (low < high) {
+        int middle = (low + high) / 2;
+        if (strcmp(E.word_table[E.word_order[middle]].text, prefix) < 0) low = middle + 1;
+        else high = middle;
+    }
+
+    int count = 0;
+    for (int k = low; k < E.word_ordered && count < max; k++) {
+        wordEntry* word = &E.word_table[E.word_order[k]];
+        if (strncmp(word->text, prefix, length)) break;
+        if (word->rows > 0 && word->length > length) ids[count++] = E.word_order[k];
+    }
+
+    // Words not merged yet go in their place
+    for (int id = E.word_ordered; id < E.word_count; id++) {
+        wordEntry* word = &E.word_table[id];
+        if (word->rows == 0 || word->length <= length || strncmp(word->text, prefix, length)) continue;
+
+        int at = count;
+        while (at > 0 && editorWordCompare(&ids[at - 1], &id) > 0) at--;
+        if (at == max) continue;
+        if (count < max) count++;
+        memmove(&ids[at + 1], &ids[at], sizeof(int) * (count - 1 - at));
+        ids[at] = id;
+    }
+    return count;
+}
+
+// Ctrl-Space completes the word before the cursor with the words of the
+// text; pressing it again goes through the other candidates and back to
+// what was typed
+void editorComplete() {
+    static char prefix[WORD_MAX_LENGTH + 1];
+    static char candidates[WORD_COMPLETIONS][WORD_MAX_LENGTH + 1];
+    static int count = 0, inserted = 0, choice = 0;
+    static int last_y = -1, last_x = -1, last_generation = -1;
+
+    if (E.cursor_y >= E.num_rows) return;
+    editorRow* row = &E.row[E.cursor_y];
+    editorRowThaw(row);
+
+    // The candidates are taken once, so the words made while going through
+    // them don't join in
+    if (E.cursor_y != last_y || E.cursor_x != last_x || E.edit_generation != last_generation) {
+        int start = E.cursor_x, end = E.cursor_x;
+        while (start > 0 && editorIsWordChar(row->text->line[start - 1])) start--;
+        while (end < row->size && editorIsWordChar(row->text->line[end])) end++;
+        if (start == E.cursor_x || E.cursor_x - start > WORD_MAX_LENGTH || isdigit((unsigned char) row->text->line[start])) {
+            editorSetStatusMessage("Nothing to complete");
+            return;
+        }
+        memcpy(prefix, &row->text->line[start], E.cursor_x - start);
+        prefix[E.cursor_x - start] = '\0';
+
+        // Neither is the word the cursor is in, unless other rows have it
+        int ids[WORD_COMPLETIONS + 1];
+        int found = editorWordsComplete(prefix, ids, WORD_COMPLETIONS + 1);
+        count = 0;
+        for (int j = 0; j < found && count < WORD_COMPLETIONS; j++) {
+            wordEntry* word = &E.word_table[ids[j]];
+            if (word->rows == 1 && word->length == end - start && !memcmp(word->text, &row->text->line[start], end - start))
+                continue;
+            strcpy(candidates[count++], word->text);
+        }
+        if (count == 0) {
+            editorSetStatusMessage("No completions for %.30s%s", prefix, E.word_next < E.num_rows ? " yet" : "");
+            return;
+        }
+        inserted = 0;
+        choice = -1;
+    }
+    choice = choice + 1 > count ? 0 : choice + 1;
+
+    // The last choice puts back the prefix alone
+    int length = strlen(prefix);
+    char* suffix = choice < count ? candidates[choice] + length : "";
+    int suffix_length = strlen(suffix);
+    int at = E.cursor_x - inserted;
+    row->text->line = realloc(row->text->line, row->size - inserted + suffix_length + 1);
+    memmove(&row->text->line[at + suffix_length], &row->text->line[E.cursor_x], row->size - E.cursor_x + 1);
+    memcpy(&row->text->line[at], suffix, suffix_length);
+    row->size += suffix_length - inserted;
+    editorUpdateRow(row);
+    E.dirty++;
+
+    E.cursor_x = at + suffix_length;
+    inserted = suffix_length;
+    last_y = E.cursor_y;
+    last_x = E.cursor_x;
+    last_generation = E.edit_generation;
+    if (choice < count)
+        editorSetStatusMessage("Completion %d of %d%s", choice + 1, count, count == WORD_COMPLETIONS ? "+" : "");
+    else
+        editorSetStatusMessage("Back to %.30s", prefix);
+}
+
+/*** Changes ***/
+
+// 64-bit FNV-1a, wide enough that equal hashes can stand for equal lines
+unsigned long long editorHashLine(const char* s, int length) {
+    unsigned long long hash = 14695981039346656037ull;
+    for (int j = 0; j < length; j++) {
+        hash ^= (unsigned char) s[j];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+// Remembers the row's text as the one on disk
+void editorRowMarkSaved(editorRow* row) {
+    row->saved = 1;
+    row->saved_hash = row->hash;
+    row->removed_before = 0;
+}
+
+void editorMarkSaved() {
+    for (int j = 0; j < E.num_rows; j++)
+        editorRowMarkSaved(&E.row[j]);
+    E.removed_tail = 0;
+    E.redraw = 1;
+}
+
+// The gutter takes one column from the text
+void editorToggleGutter() {
+    int top_row = editorDisplayToRow(E.row_offest);
+
+    E.gutter = !E.gutter;
+    E.screen_cols += E.gutter ? -1 : 1;
+    editorRewrapRows();
+
+    E.row_offest = editorRowToDisplay(top_row);
+    E.redraw = 1;
+}
+
+// '+' for added rows, '~' for changed ones and '-' where saved rows were deleted
+void editorDrawGutter(struct append_buffer *ab, int file_row, int first_line) {
+    char* mark = " ";
+    if (first_line && file_row < E.num_rows) {
+        editorRow* row = &E.row[file_row];
+        if (!row->saved) mark = "\x1b[32m+\x1b[39m";
+        else if (row->hash != row->saved_hash) mark = "\x1b[33m~\x1b[39m";
+        else if (row->removed_before) mark = "\x1b[31m-\x1b[39m";
+    } else if (first_line && file_row == E.num_rows && E.removed_tail) {
+        mark = "\x1b[31m-\x1b[39m";
+    }
+    buffer_append(ab, mark, strlen(mark));
+}
+
+// Myers' middle snake: finds a point (x, y) that an optimal edit path from
+// (0, 0) to (n, m) goes through, using O(n + m) space
+void diffBisect(unsigned long long* a, int n, unsigned long long* b, int m, int* v1, int* v2, int* x, int* y) {
+    int max_d = (n + m + 1) / 2;
+    int v_offset = max_d;
+    int v_length = 2 * max_d + 2;
+    for (int j = 0; j < v_length; j++) {
+        v1[j] = -1;
+        v2[j] = -1;
+    }
+    v1[v_offset + 1] = 0;
+    v2[v_offset + 1] = 0;
+
+    int delta = n - m;
+    int front = (delta % 2 != 0);
+    int k1_start = 0, k1_end = 0, k2_start = 0, k2_end = 0;
+
+    for (int d = 0; d < max_d; d++) {
+        for (int k1 = -d + k1_start; k1 <= d - k1_end; k1 += 2) {
+            int k1_offset = v_offset + k1;
+            int x1;
+            if (k1 == -d || (k1 != d && v1[k1_offset - 1] < v1[k1_offset + 1]))
+                x1 = v1[k1_offset + 1];
+            else
+                x1 = v1[k1_offset - 1] + 1;
+            int y1 = x1 - k1;
+            while (x1 < n && y1 < m && a[x1] == b[y1]) {
+                x1++;
+                y1++;
+            }
+            v1[k1_offset] = x1;
+
+            if (x1 > n) {
+                k1_end += 2;
+            } else if (y1 > m) {
+                k1_start += 2;
+            } else if (front) {
+                int k2_offset = v_offset + delta - k1;
+                if (k2_offset >= 0 && k2_offset < v_length && v2[k2_offset] != -1 && x1 >= n - v2[k2_offset]) {
+                    *x = x1;
+                    *y = y1;
+                    return;
+                }
+            }
+        }
+
+        for (int k2 = -d + k2_start; k2 <= d - k2_end; k2 += 2) {
+            int k2_offset = v_offset + k2;
+            int x2;
+            if (k2 == -d || (k2 != d && v2[k2_offset - 1] < v2[k2_offset + 1]))
+                x2 = v2[k2_offset + 1];
+            else
+                x2 = v2[k2_offset - 1] + 1;
+            int y2 = x2 - k2;
+            while (x2 < n && y2 < m && a[n - x2 - 1] == b[m - y2 - 1]) {
+                x2++;
+                y2++;
+            }
+            v2[k2_offset] = x2;
+
+            if (x2 > n) {
+                k2_end += 2;
+            } else if (y2 > m) {
+                k2_start += 2;
+            } else if (!front) {
+                int k1_offset = v_offset + delta - k2;
+                if (k1_offset >= 0 && k1_offset < v_length && v1[k1_offset] != -1) {
+                    int x1 = v1[k1_offset];
+                    if (x1 >= n - x2) {
+                        *x = x1;
+                        *y = v_offset + x1 - k1_offset;
+                        return;
+                    }
+                }
+            }
+        }
+    }
+
+    // Nothing in common
+    *x = n;
+    *y = 0;
+}
+
+// Marks the lines of a removed and of b added by a shortest edit script
+void diffCompare(unsigned long long* a, int n, unsigned long long* b, int m, char* removed, char* added, int* v1, int* v2) {
+    while (n > 0 && m > 0 && a[0] == b[0]) {
+        a++; b++; removed++; added++;
+        n--; m--;
+    }
+    while (n > 0 && m > 0 && a[n - 1] == b[m - 1]) {
+        n--;
+        m--;
+    }
+
+    if (n == 0 || m == 0) {
+        memset(removed, 1, n);
+        memset(added, 1, m);
+        return;
+    }
+
+    int x, y;
+    diffBisect(a, n, b, m, v1, v2, &x, &y);
+    if ((x == n && y == 0) || (x == 0 && y == m)) {
+        memset(removed, 1, n);
+        memset(added, 1, m);
+        return;
+    }
+    diffCompare(a, x, b, y, removed, added, v1, v2);
+    diffCompare(a + x, n - x, b + y, m - y, removed + x, added + y, v1, v2);
+}
+
+// Shows the unsaved changes as a unified diff against the file on disk;
+// Enter jumps to the line under the selection
+void editorShowDiff() {
+    if (E.loading) {
+        editorSetStatusMessage("Can't diff while the file is still loading");
+        return;
+    }
+
+    char** lines;
+    size_t* lengths;
+    int n = E.filename ? editorReadLines(E.filename, &lines, &lengths) : -1;
+    if (n == -1) {
+        n = 0;
+        lines = NULL;
+        lengths = NULL;
+    }
+    int m = E.num_rows;
+
+    unsigned long long* a = malloc(sizeof(unsigned long long) * (n + 1));
+    unsigned long long* b = malloc(sizeof(unsigned long long) * (m + 1));
+    for (int j = 0; j < n; j++)
+        a[j] = editorHashLine(lines[j], lengths[j]);
+    for (int j = 0; j < m; j++)
+        b[j] = E.row[j].hash;
+
+    char* removed = calloc(n + 1, 1);
+    char* added = calloc(m + 1, 1);
+    int* v1 = malloc(sizeof(int) * (n + m + 4));
+    int* v2 = malloc(sizeof(int) * (n + m + 4));
+    diffCompare(a, n, b, m, removed, added, v1, v2);
+    free(v1);
+    free(v2);
+    free(a);
+    free(b);
+
+    editorView view = { "Unsaved changes", NULL, NULL, NULL, 0, 0, NULL, NULL, NULL, NULL };
+    int i = 0, j = 0;
+    while (i < n || j < m) {
+        if ((i < n && removed[i]) || (j < m && added[j])) {
+            // A hunk: context before, then changes until two contexts apart
+            int context = 0;
+            while (context < DIFF_CONTEXT && i - context > 0 && j - context > 0 &&
+                   !removed[i - context - 1] && !added[j - context - 1])
+                context++;
+            int hunk_i = i - context, hunk_j = j - context;
+
+            int end_i = i, end_j = j, equal = 0;
+            while ((end_i < n || end_j < m) && equal <= 2 * DIFF_CONTEXT) {
+                if (end_i < n && removed[end_i]) {
+                    end_i++;
+                    equal = 0;
+                } else if (end_j < m && added[end_j]) {
+                    end_j++;
+                    equal = 0;
+                } else {
+                    end_i++;
+                    end_j++;
+                    equal++;
+                }
+            }
+            if (equal > DIFF_CONTEXT) {
+                end_i -= equal - DIFF_CONTEXT;
+                end_j -= equal - DIFF_CONTEXT;
+            }
+            if (end_i > n) end_i = n;
+            if (end_j > m) end_j = m;
+
+            editorViewAppend(&view, 36, hunk_j, "@@ -%d,%d +%d,%d @@",
+                             hunk_i + 1, end_i - hunk_i, hunk_j + 1, end_j - hunk_j);
+            i = hunk_i;
+            j = hunk_j;
+            while (i < end_i || j < end_j) {
+                if (i < end_i && removed[i]) {
+                    editorViewAppend(&view, 31, j, "-%.*s", (int) lengths[i], lines[i]);
+                    i++;
+                } else if (j < end_j && added[j]) {
+                    editorViewAppend(&view, 32, j, "+%s", editorRowLine(&E.row[j]));
+                    j++;
+                } else {
+                    editorViewAppend(&view, -1, j, " %s", editorRowLine(&E.row[j]));
+                    i++;
+                    j++;
+                }
+            }
+        } else {
+            i++;
+            j++;
+        }
+    }
+
+    for (int k = 0; k < n; k++) free(lines[k]);
+    free(lines);
+    free(lengths);
+    free(removed);
+    free(added);
+
+    if (view.count == 0) {
+        editorSetStatusMessage("No unsaved changes");
+        return;
+    }
+
+    int selected = editorRunView(&view);
+    if (selected != -1) {
+        int row = view.tags[selected];
+        E.cursor_y = row < E.num_rows ? row : E.num_rows;
+        E.cursor_x = 0;
+        editorUnfoldRange(E.cursor_y, 1);
+    }
+    editorFreeView(&view);
+}
+
+/*** Views ***/
+
+void editorViewAppend(editorView* view, int color, int tag, const char* fmt, ...) {
+    if (view->count == view->cap) {
+        view->cap = view->cap ? view->cap * 2 : 64;
+        view->lines = realloc(view->lines, sizeof(char*) * view->cap);
+        view->colors = realloc(view->colors, sizeof(int) * view->cap);
+        view->tags = realloc(view->tags, sizeof(int) * view->cap);
+        view->match_starts = realloc(view->match_starts, sizeof(int) * view->cap);
+        view->match_lengths = realloc(view->match_lengths, sizeof(int) * view->cap);
+    }
+
+    va_list ap;
+    va_start(ap, fmt);
+    if (vasprintf(&view->lines[view->count], fmt, ap) == -1)
+        die("editorViewAppend failed");
+    va_end(ap);
+
+    view->colors[view->count] = color;
+    view->tags[view->count] = tag;
+    view->match_starts[view->count] = -1;
+    view->match_lengths[view->count] = 0;
+    view->count++;
+}
+
+// Highlights part of the line appended last like a search match
+void editorViewMatch(editorView* view, int start, int length) {
+    view->match_starts[view->count - 1] = start;
+    view->match_lengths[view->count - 1] = length;
+}
+
+void editorDrawView(editorView* view, int offset, int selected) {
+    struct append_buffer ab = ABUF_INIT;
+    int width = E.screen_cols + E.gutter;
+
+    buffer_append(&ab, "\x1b[?2026h", 8);
+    buffer_append(&ab, "\x1b[?25l", 6);
+    buffer_append(&ab, "\x1b[H", 3);
+
+    for (int i = 0; i < E.screen_rows; i++) {
+        int line = offset + i;
+        if (line < view->count) {
+            int length = strlen(view->lines[line]);
+            if (length > width) length = width;
+            int current_color = -1;
+            if (line == selected) buffer_append(&ab, "\x1b[7m", 4);
+            int match = view->match_starts[line];
+            if (match >= 0 && match < length) {
+                int match_end = match + view->match_lengths[line];
+                if (match_end > length) match_end = length;
+                editorDrawText(&ab, view->lines[line], match, view->colors[line], &current_color);
+                editorDrawText(&ab, &view->lines[line][match], match_end - match,
+                               editorSyntaxToColor(HIGHLIGHT_MATCH), &current_color);
+                editorDrawText(&ab, &view->lines[line][match_end], length - match_end,
+                               view->colors[line], &current_color);
+            } else {
+                editorDrawText(&ab, view->lines[line], length, view->colors[line], &current_color);
+            }
+            buffer_append(&ab, "\x1b[39m\x1b[m", 8);
+        } else {
+            buffer_append(&ab, "~", 1);
+        }
+        buffer_append(&ab, "\x1b[K\r\n", 5);
+    }
+
+    char status[80];
+    int status_length = snprintf(status, sizeof(status), "%.40s - %d/%d",
+                                 view->title, selected + 1, view->count);
+    if (status_length > width) status_length = width;
+    buffer_append(&ab, "\x1b[7m", 4);
+    buffer_append(&ab, status, status_length);
+    while (status_length++ < width) buffer_append(&ab, " ", 1);
+    buffer_append(&ab, "\x1b[m\r\n\x1b[K", 8);
+
+    char* help = "Enter = go to line | ESC = close";
+    buffer_append(&ab, help, (int) strlen(help) < width ? (int) strlen(help) : width);
+    buffer_append(&ab, "\x1b[?2026l", 8);
+
+    if (write(STDOUT_FILENO, ab.buf, ab.len) == -1) {}
+    buffer_free(&ab);
+}
+
+// Shows the view until a line is picked with Enter (its index is returned)
+// or the view is closed with ESC or q (-1)
+int editorRunView(editorView* view) {
+    int offset = 0;
+    int selected = 0;
+
+    while (1) {
+        if (selected < offset) offset = selected;
+        if (selected >= offset + E.screen_rows) offset = selected - E.screen_rows + 1;
+        editorDrawView(view, offset, selected);
+
+        // Lines still coming in are picked up while waiting for a key
+        if (view->update && !E.replaying) {
+            struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+            if (poll(&pfd, 1, VIEW_POLL_MS) <= 0) {
+                if (!view->update(view)) view->update = NULL;
+                continue;
+            }
+        }
+
+        int c = editorReadKey();
+        switch (c) {
+            case ARROW_UP:
+                if (selected > 0) selected--;
+                break;
+            case ARROW_DOWN:
+                if (selected < view->count - 1) selected++;
+                break;
+            case PAGE_UP:
+                selected = selected > E.screen_rows ? selected - E.screen_rows : 0;
+                break;
+            case PAGE_DOWN:
+                selected += E.screen_rows;
+                if (selected > view->count - 1) selected = view->count - 1;
+                break;
+            case HOME_KEY:
+                selected = 0;
+                break;
+            case END_KEY:
+                selected = view->count - 1;
+                break;
+            case '\r':
+                E.redraw = 1;
+                return selected;
+            case '\x1b':
+            case 'q':
+                E.redraw = 1;
+                return -1;
+        }
+    }
+}
+
+void editorFreeView(editorView* view) {
+    for (int j = 0; j < view->count; j++)
+        free(view->lines[j]);
+    free(view->lines);
+    free(view->colors);
+    free(view->tags);
+    free(view->match_starts);
+    free(view->match_lengths);
+}
+
+
+/*** Project Search ***/
+
+// Ctrl-E grep [-i] [-e] PATTERN: searches the files under the current
+// directory, showing hits as they come in; Enter opens the file at the hit
+void editorGrep(char* args) {
+    int regex = 0, icase = 0;
+    while (args[0] == '-' && (args[1] == 'e' || args[1] == 'i') && args[2] == ' ') {
+        if (args[1] == 'e') regex = 1;
+        else icase = 1;
+        args += 3;
+        while (*args == ' ') args++;
+    }
+    if (!*args) {
+        editorSetStatusMessage("Usage: grep [-i] [-e] PATTERN");
+        return;
+    }
+
+    grepSearch search;
+    memset(&search, 0, sizeof(search));
+    search.query = args;
+    search.pattern = strdup(args);
+    search.pattern_length = strlen(args);
+
+    // Case-insensitive literals go through the regex kernel with the special
+    // characters escaped
+    if (icase && !regex) {
+        char* escaped = malloc(search.pattern_length * 2 + 1);
+        int length = 0;
+        for (char* c = args; *c; c++) {
+            if (strchr(".[]()*+?{}|^$\\", *c)) escaped[length++] = '\\';
+            escaped[length++] = *c;
+        }
+        escaped[length] = '\0';
+        free(search.pattern);
+        search.pattern = escaped;
+        regex = 1;
+    }
+    search.regex = regex;
+    search.flags = REG_EXTENDED | REG_NEWLINE | (icase ? REG_ICASE : 0);
+
+    if (regex) {
+        regex_t compiled;
+        int error = regcomp(&compiled, search.pattern, search.flags);
+        if (error) {
+            char message[80];
+            regerror(error, &compiled, message, sizeof(message));
+            editorSetStatusMessage("Bad pattern: %s", message);
+            free(search.pattern);
+            return;
+        }
+        regfree(&compiled);
+    }
+
+    long processors = sysconf(_SC_NPROCESSORS_ONLN);
+    search.worker_count = processors < 1 ? 1 : processors > GREP_MAX_THREADS ? GREP_MAX_THREADS : processors;
+    search.running = search.worker_count;
+    search.workers = malloc(sizeof(pthread_t) * search.worker_count);
+    pthread_mutex_init(&search.lock, NULL);
+    pthread_cond_init(&search.ready, NULL);
+    if (pthread_create(&search.walker, NULL, grepWalk, &search) != 0) die("pthread_create failed");
+    for (int t = 0; t < search.worker_count; t++) {
+        if (pthread_create(&search.workers[t], NULL, grepWorker, &search) != 0) die("pthread_create failed");
+    }
+
+    editorView view = { search.title, NULL, NULL, NULL, 0, 0, NULL, NULL, grepUpdate, &search };
+    grepUpdate(&view);
+    int selected = editorRunView(&view);
+
+    pthread_mutex_lock(&search.lock);
+    search.cancel = 1;
+    pthread_cond_broadcast(&search.ready);
+    pthread_mutex_unlock(&search.lock);
+    pthread_join(search.walker, NULL);
+    for (int t = 0; t < search.worker_count; t++)
+        pthread_join(search.workers[t], NULL);
+    pthread_mutex_destroy(&search.lock);
+    pthread_cond_destroy(&search.ready);
+
+    char* path = NULL;
+    int line = 0;
+    if (selected >= 0 && selected < view.count) {
+        grepHit* hit = search.hits[view.tags[selected]];
+        path = strdup(hit->path);
+        line = hit->line;
+    }
+
+    while (search.head) {
+        grepHit* next = search.head->next;
+        free(search.head->text);
+        free(search.head);
+        search.head = next;
+    }
+    for (int j = 0; j < search.hit_count; j++) {
+        free(search.hits[j]->text);
+        free(search.hits[j]);
+    }
+    for (int j = 0; j < search.path_count; j++)
+        free(search.paths[j]);
+    free(search.hits);
+    free(search.paths);
+    free(search.workers);
+    free(search.pattern);
+    editorFreeView(&view);
+
+    if (path) editorOpenAt(path, line);
+    free(path);
+}
+
+// Walker thread: queues every regular file below the current directory,
+// skipping hidden files and directories and symbolic links
+void* grepWalk(void* arg) {
+    grepSearch* search = arg;
+    grepWalkDirectory(search, ".");
+
+    pthread_mutex_lock(&search->lock);
+    search->walked = 1;
+    pthread_cond_broadcast(&search->ready);
+    pthread_mutex_unlock(&search->lock);
+    return NULL;
+}
+
+void grepWalkDirectory(grepSearch* search, char* directory) {
+    DIR* dir = opendir(directory);
+    if (!dir) return;
+
+    struct dirent* entry;
+    while ((entry = readdir(dir)) && !grepCancelled(search)) {
+        if (entry->d_name[0] == '.') continue;
+
+        char* path;
+        if (!strcmp(directory, "."))
+            path = strdup(entry->d_name);
+        else if (asprintf(&path, "%s/%s", directory, entry->d_name) == -1)
+            continue;
+
+        int type = entry->d_type;
+        if (type == DT_UNKNOWN) {
+            struct stat st;
+            type = lstat(path, &st) == -1 ? DT_UNKNOWN :
+                   S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+        }
+
+        if (type == DT_DIR) {
+            grepWalkDirectory(search, path);
+            free(path);
+        } else if (type == DT_REG) {
+            pthread_mutex_lock(&search->lock);
+            if (search->path_count == search->path_cap) {
+                search->path_cap = search->path_cap ? search->path_cap * 2 : 256;
+                search->paths = realloc(search->paths, sizeof(char*) * search->path_cap);
+            }
+            search->paths[search->path_count++] = path;
+            pthread_cond_signal(&search->ready);
+            pthread_mutex_unlock(&search->lock);
+        } else {
+            free(path);
+        }
+    }
+    closedir(dir);
+}
+
+// Worker thread: takes queued files until the walk is over and the queue
+// is empty, or the search is cancelled
+void* grepWorker(void* arg) {
+    grepSearch* search = arg;
+
+    // Compiled patterns aren't shared, regexec serializes on them
+    regex_t regex;
+    if (search->regex) regcomp(&regex, search->pattern, search->flags);
+
+    pthread_mutex_lock(&search->lock);
+    while (1) {
+        while (search->path_next == search->path_count && !search->walked && !search->cancel)
+            pthread_cond_wait(&search->ready, &search->lock);
+        if (search->cancel || search->path_next == search->path_count) break;
+
+        char* path = search->paths[search->path_next++];
+        pthread_mutex_unlock(&search->lock);
+        grepFile(search, path, search->regex ? &regex : NULL);
+        pthread_mutex_lock(&search->lock);
+    }
+    search->running--;
+    pthread_mutex_unlock(&search->lock);
+
+    if (search->regex) regfree(&regex);
+    return NULL;
+}
+
+// Searches one mapped file, one hit per matching line. Files with a NUL in
+// their first block are taken to be binary and skipped.
+void grepFile(grepSearch* search, char* path, regex_t* regex) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return;
+
+    struct stat st;
+    // Match offsets of the regex kernel are ints
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0 ||
+        (regex && st.st_size > INT_MAX)) {
+        close(fd);
+        return;
+    }
+    size_t size = st.st_size;
+    char* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return;
+    madvise(data, size, MADV_SEQUENTIAL);
+
+    int binary = memchr(data, '\0', size < GREP_BINARY_PROBE ? size : GREP_BINARY_PROBE) != NULL;
+    grepHit* head = NULL;
+    grepHit* tail = NULL;
+    int count = 0;
+    char* end = data + size;
+    char* counted = data;
+    int line = 1;
+
+    for (char* at = data; !binary && at < end && !grepCancelled(search); ) {
+        // Either kernel scans the rest of the file in one call, the regex
+        // one with the preceding text still visible for ^ and \b
+        char* found;
+        int length;
+        if (regex) {
+            regmatch_t match;
+            match.rm_so = at - data;
+            match.rm_eo = size;
+            if (regexec(regex, data, 1, &match, REG_STARTEND) != 0) break;
+            found = data + match.rm_so;
+            length = match.rm_eo - match.rm_so;
+        } else {
+            found = memmem(at, end - at, search->pattern, search->pattern_length);
+            if (!found) break;
+            length = search->pattern_length;
+        }
+
+        char* line_start = memrchr(at, '\n', found - at);
+        line_start = line_start ? line_start + 1 : at;
+        char* line_end = memchr(found, '\n', end - found);
+        if (!line_end) line_end = end;
+        at = line_end + 1;
+        int column = found - line_start;
+
+        // Line numbers are counted only up to each hit
+        for (char* newline; (newline = memchr(counted, '\n', line_start - counted)); counted = newline + 1)
+            line++;
+        counted = line_start;
+
+        int text_length = line_end - line_start;
+        if (text_length > 0 && line_start[text_length - 1] == '\r') text_length--;
+        if (text_length > GREP_LINE_BYTES) text_length = GREP_LINE_BYTES;
+        if (column > text_length) column = text_length;
+        if (column + length > text_length) length = text_length - column;
+
+        grepHit* hit = malloc(sizeof(grepHit));
+        hit->path = path;
+        hit->line = line;
+        hit->column = column;
+        hit->length = length;
+        hit->text = malloc(text_length + 1);
+        for (int j = 0; j < text_length; j++)
+            hit->text[j] = line_start[j] == '\t' ? ' ' : line_start[j];
+        hit->text[text_length] = '\0';
+        hit->next = NULL;
+        if (tail) tail->next = hit;
+        else head = hit;
+        tail = hit;
+        count++;
+    }
+    munmap(data, size);
+
+    pthread_mutex_lock(&search->lock);
+    search->files++;
+    if (binary) search->binary++;
+    if (head) {
+        if (search->tail) search->tail->next = head;
+        else search->head = head;
+        search->tail = tail;
+        search->found += count;
+        if (search->found >= GREP_MAX_HITS) search->cancel = 1;
+    }
+    pthread_mutex_unlock(&search->lock);
+}
+
+// The cancel flag is written by the view and the workers, so it is only
+// read under the lock
+int grepCancelled(grepSearch* search) {
+    pthread_mutex_lock(&search->lock);
+    int cancel = search->cancel;
+    pthread_mutex_unlock(&search->lock);
+    return cancel;
+}
+
+// Moves the hits found since the last call into the view. Returns 0 once
+// the search is over.
+int grepUpdate(editorView* view) {
+    grepSearch* search = view->data;
+
+    pthread_mutex_lock(&search->lock);
+    grepHit* hit = search->head;
+    search->head = search->tail = NULL;
+    int running = search->running > 0;
+    int files = search->files;
+    int binary = search->binary;
+    int capped = search->found >= GREP_MAX_HITS;
+    pthread_mutex_unlock(&search->lock);
+
+    for (; hit; hit = hit->next) {
+        if (search->hit_count == search->hit_cap) {
+            search->hit_cap = search->hit_cap ? search->hit_cap * 2 : 256;
+            search->hits = realloc(search->hits, sizeof(grepHit*) * search->hit_cap);
+        }
+        search->hits[search->hit_count] = hit;
+
+        int prefix = snprintf(NULL, 0, "%s:%d: ", hit->path, hit->line);
+        editorViewAppend(view, -1, search->hit_count, "%s:%d: %s", hit->path, hit->line, hit->text);
+        editorViewMatch(view, prefix + hit->column, hit->length);
+        search->hit_count++;
+    }
+
+    snprintf(search->title, sizeof(search->title), "%.20s: %d files%s%s",
+             search->query, files - binary, capped ? " (stopped)" : "", running ? "..." : "");
+    return running;
+}
+
+
+/*** Filters ***/
+
+// Ctrl-E: sort [-n] [-r] [-k N] [-t C], uniq, keep PATTERN, delete PATTERN,
+// cursors PATTERN or grep [-i] [-e] PATTERN
+void editorCommand() {
+    if (E.loading) {
+        editorSetStatusMessage("Can't run commands while the file is still loading");
+        return;
+    }
+
+    char* command = editorPrompt("Command: %s (sort [-n -r -k N -t C] | uniq | keep/delete/cursors RE | grep)", NULL);
+    if (command == NULL) return;
+    // Commands move rows around, so cursors on them would be stale
+    editorClearCursors();
+
+    char* name = command;
+    while (*name == ' ') name++;
+    char* args = name;
+    while (*args && *args != ' ') args++;
+    if (*args) *args++ = '\0';
+    while (*args == ' ') args++;
+
+    if (!strcmp(name, "sort")) {
+        int numeric = 0, reverse = 0, column = 1;
+        char separator = 0;
+        for (char* option = strtok(args, " "); option; option = strtok(NULL, " ")) {
+            if (!strcmp(option, "-n")) {
+                numeric = 1;
+            } else if (!strcmp(option, "-r")) {
+                reverse = 1;
+            } else if (!strcmp(option, "-k") && (option = strtok(NULL, " "))) {
+                column = atoi(option);
+            } else if (!strcmp(option, "-t") && (option = strtok(NULL, " "))) {
+                separator = option[0];
+            } else {
+                column = 0;
+                break;
+            }
+        }
+        if (column < 1)
+            editorSetStatusMessage("Usage: sort [-n] [-r] [-k N] [-t C]");
+        else
+            editorSortRows(numeric, reverse, column, separator);
+    } else if (!strcmp(name, "uniq")) {
+        editorUniqRows();
+    } else if ((!strcmp(name, "keep") || !strcmp(name, "delete")) && *args) {
+        editorFilterRows(args, name[0] == 'k');
+    } else if (!strcmp(name, "cursors") && *args) {
+        editorCursorsFromPattern(args);
+    } else if (!strcmp(name, "grep")) {
+        editorGrep(args);
+    } else if (*name) {
+        editorSetStatusMessage("Unknown command: %.40s", name);
+    }
+    free(command);
+}
+
+int sortCompare(sortKey* a, sortKey* b, int numeric, int reverse) {
+    int result;
+    if (numeric) {
+        result = (a->number > b->number) - (a->number < b->number);
+    } else if (a->prefix != b->prefix) {
+        result = a->prefix > b->prefix ? 1 : -1;
+    } else {
+        int length = a->length < b->length ? a->length : b->length;
+        result = memcmp(a->text, b->text, length);
+        if (result == 0) result = (a->length > b->length) - (a->length < b->length);
+    }
+    return reverse ? -result : result;
+}
+
+// Stable merge of two adjacent sorted runs through the scratch array
+void sortMergeRuns(sortJob* job) {
+    sortKey* keys = job->keys;
+    int i = job->from, j = job->middle, out = job->from;
+    if (i == j || j == job->to ||
+        sortCompare(&keys[j - 1], &keys[j], job->numeric, job->reverse) <= 0) return;
+
+    while (i < job->middle && j < job->to) {
+        if (sortCompare(&keys[j], &keys[i], job->numeric, job->reverse) < 0)
+            job->scratch[out++] = keys[j++];
+        else
+            job->scratch[out++] = keys[i++];
+    }
+    while (i < job->middle) job->scratch[out++] = keys[i++];
+    while (j < job->to) job->scratch[out++] = keys[j++];
+    memcpy(&keys[job->from], &job->scratch[job->from], sizeof(sortKey) * (job->to - job->from));
+}
+
+void sortKeys(sortJob* job) {
+    if (job->to - job->from <= 16) {
+        // Insertion sort for short runs
+        for (int i = job->from + 1; i < job->to; i++) {
+            sortKey key = job->keys[i];
+            int j = i;
+            while (j > job->from && sortCompare(&key, &job->keys[j - 1], job->numeric, job->reverse) < 0) {
+                job->keys[j] = job->keys[j - 1];
+                j--;
+            }
+            job->keys[j] = key;
+        }
+        return;
+    }
+
+    sortJob half = *job;
+    half.to = job->from + (job->to - job->from) / 2;
+    sortKeys(&half);
+    half.from = half.to;
+    half.to = job->to;
+    sortKeys(&half);
+
+    sortJob merge = *job;
+    merge.middle = half.from;
+    sortMergeRuns(&merge);
+}
+
+void* sortThread(void* arg) {
+    sortKeys(arg);
+    return NULL;
+}
+
+void* mergeThread(void* arg) {
+    sortMergeRuns(arg);
+    return NULL;
+}
+
+// Merge sort with the runs sorted, then pairwise merged, by a thread each
+void sortParallel(sortKey* keys, int count, int numeric, int reverse) {
+    sortKey* scratch = malloc(sizeof(sortKey) * (count + 1));
+
+    int threads = 1;
+    if (count >= SORT_PARALLEL_ROWS) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus < 1 ? 1 : cpus > SORT_MAX_THREADS ? SORT_MAX_THREADS : cpus;
+    }
+
+    int bounds[SORT_MAX_THREADS + 1];
+    for (int t = 0; t <= threads; t++)
+        bounds[t] = (int)((long long) count * t / threads);
+
+    sortJob jobs[SORT_MAX_THREADS];
+    pthread_t ids[SORT_MAX_THREADS];
+    for (int t = 0; t < threads; t++) {
+        jobs[t] = (sortJob) { keys, scratch, bounds[t], bounds[t], bounds[t + 1], numeric, reverse };
+        if (threads == 1 || pthread_create(&ids[t], NULL, sortThread, &jobs[t]) != 0) {
+            sortKeys(&jobs[t]);
+            ids[t] = pthread_self();
+        }
+    }
+    for (int t = 0; t < threads; t++)
+        if (!pthread_equal(ids[t], pthread_self())) pthread_join(ids[t], NULL);
+
+    for (int runs = threads, width = 1; runs > 1; runs = (runs + 1) / 2, width *= 2) {
+        int merges = 0;
+        for (int t = 0; t + width < threads; t += 2 * width) {
+            int to = t + 2 * width < threads ? t + 2 * width : threads;
+            jobs[merges] = (sortJob) { keys, scratch, bounds[t], bounds[t + width], bounds[to], numeric, reverse };
+            if (pthread_create(&ids[merges], NULL, mergeThread, &jobs[merges]) != 0) {
+                sortMergeRuns(&jobs[merges]);
+                ids[merges] = pthread_self();
+            }
+            merges++;
+        }
+        for (int t = 0; t < merges; t++)
+            if (!pthread_equal(ids[t], pthread_self())) pthread_join(ids[t], NULL);
+    }
+
+    free(scratch);
+}
+
+// Sorts the rows by their column-th field (split on separator, or on runs
+// of blanks when it is 0). Only the row structs move, not their text; the
+// keys of cold rows are read from a copy rather than thawing them.
+void editorSortRows(int numeric, int reverse, int column, char separator) {
+    if (E.num_rows < 2) return;
+
+    size_t cold_bytes = 0;
+    for (int j = 0; j < E.num_rows; j++)
+        if (E.row[j].cold) cold_bytes += E.row[j].size + 1;
+    char* cold_text = malloc(cold_bytes + 1);
+    char* copy = cold_text;
+
+    sortKey* keys = malloc(sizeof(sortKey) * E.num_rows);
+    for (int j = 0; j < E.num_rows; j++) {
+        editorRow* row = &E.row[j];
+        char* text;
+        if (row->cold) {
+            memcpy(copy, editorRowLine(row), row->size + 1);
+            text = copy;
+            copy += row->size + 1;
+        } else {
+            text = row->text->line;
+        }
+
+        char* end = text + row->size;
+        for (int field = 1; field < column && text < end; field++) {
+            if (separator) {
+                char* next = memchr(text, separator, end - text);
+                text = next ? next + 1 : end;
+            } else {
+                while (text < end && isspace((unsigned char) *text)) text++;
+                while (text < end && !isspace((unsigned char) *text)) text++;
+            }
+        }
+        if (!separator)
+            while (text < end && isspace((unsigned char) *text)) text++;
+
+        keys[j].prefix = 0;
+        for (int i = 0; i < 8; i++)
+            keys[j].prefix = keys[j].prefix << 8 | (text + i < end ? (unsigned char) text[i] : 0);
+        keys[j].text = text;
+        keys[j].length = end - text;
+        keys[j].number = numeric ? strtod(text, NULL) : 0;
+        keys[j].row = j;
+    }
+
+    sortParallel(keys, E.num_rows, numeric, reverse);
+    editorApplyOrder(keys);
+    free(keys);
+    free(cold_text);
+}
+
+// Moves E.row into the order of keys. A moved row counts as a new row at
+// its position, replacing the one that was there.
+void editorApplyOrder(sortKey* keys) {
+    editorUnfoldRange(0, E.num_rows);
+
+    // Cold blocks hold runs of neighbouring rows: moved rows are thawed, in
+    // their old order so each block is decompressed once
+    char* moving = calloc(E.num_rows, 1);
+    for (int j = 0; j < E.num_rows; j++)
+        if (keys[j].row != j) moving[keys[j].row] = 1;
+    for (int j = 0; j < E.num_rows; j++)
+        if (moving[j]) editorRowThaw(&E.row[j]);
+    free(moving);
+
+    editorRow* rows = malloc(sizeof(editorRow) * E.num_rows);
+    int moved = 0;
+    for (int j = 0; j < E.num_rows; j++) {
+        rows[j] = E.row[keys[j].row];
+        if (keys[j].row == j) continue;
+
+        rows[j].saved = 0;
+        rows[j].removed_before = E.row[j].saved + E.row[j].removed_before;
+        moved++;
+    }
+    memcpy(E.row, rows, sizeof(editorRow) * E.num_rows);
+    free(rows);
+
+    if (moved == 0) {
+        editorSetStatusMessage("Already in order");
+        return;
+    }
+
+    for (int j = 0; j < E.num_rows; j++) {
+        editorRow* row = &E.row[j];
+        if (row->index == j) continue;
+        row->index = j;
+        if (E.trigram) {
+            E.id_rows[row->id] = j;
+            // The initial build has passed this position
+            if (row->trigrams == 0 && j < E.trigram_next) editorTrigramQueue(row->id);
+        }
+        if (row->words == 0 && j < E.word_next) editorWordsAddRow(row);
+        if (E.syntax) editorUpdateSyntax(row);
+    }
+    if (E.trigram) E.trigram_version++;
+    if (E.stale_first != -1) {
+        E.stale_first = 0;
+        E.stale_last = E.num_rows - 1;
+    }
+
+    E.display_tree_stale = 1;
+    E.redraw = 1;
+    E.dirty++;
+    if (E.cursor_y < E.num_rows && E.cursor_x > E.row[E.cursor_y].size)
+        E.cursor_x = E.row[E.cursor_y].size;
+    editorSetStatusMessage("%d lines moved", moved);
+}
+
+// Deletes every row with drop[row] set in one pass
+void editorDeleteMarked(char* drop) {
+    int first = 0;
+    while (first < E.num_rows && !drop[first]) first++;
+    if (first == E.num_rows) return;
+
+    if (E.folds) editorFoldsDropMarked(drop);
+    editorInvalidateRows(first, -1);
+
+    int kept = first, removed = 0;
+    int trigram_next = E.trigram_next, word_next = E.word_next;
+    for (int j = first; j < E.num_rows; j++) {
+        if (drop[j]) {
+            if (j < trigram_next) E.trigram_next--;
+            if (j < word_next) E.word_next--;
+            editorTrigramDrop(&E.row[j]);
+            editorWordsDrop(&E.row[j]);
+            removed += E.row[j].saved + E.row[j].removed_before;
+            editorFreeRow(&E.row[j]);
+            continue;
+        }
+
+        E.row[kept] = E.row[j];
+        E.row[kept].index = kept;
+        E.row[kept].removed_before += removed;
+        if (E.trigram) E.id_rows[E.row[kept].id] = kept;
+        if (removed && E.syntax) editorUpdateSyntax(&E.row[kept]);
+        removed = 0;
+        kept++;
+    }
+    E.removed_tail += removed;
+
+    E.num_rows = kept;
+    if (E.stale_first != -1) {
+        E.stale_first = 0;
+        E.stale_last = E.num_rows - 1;
+    }
+    E.display_tree_stale = 1;
+    E.dirty++;
+
+    if (E.cursor_y > E.num_rows) E.cursor_y = E.num_rows;
+    if (E.cursor_y < E.num_rows && E.row[E.cursor_y].hidden) editorUnfoldRange(E.cursor_y, 1);
+    if (E.cursor_y < E.num_rows && E.cursor_x > E.row[E.cursor_y].size)
+        E.cursor_x = E.row[E.cursor_y].size;
+}
+
+// Deletes rows equal to the one before them
+void editorUniqRows() {
+    if (E.num_rows < 2) return;
+
+    char* drop = calloc(E.num_rows, 1);
+    int count = 0;
+    for (int j = 1; j < E.num_rows; j++) {
+        editorRow* row = &E.row[j];
+        editorRow* previous = &E.row[j - 1];
+        if (row->hash != previous->hash || row->size != previous->size) continue;
+        editorRowThaw(previous);
+        if (memcmp(editorRowLine(row), previous->text->line, row->size)) continue;
+        drop[j] = 1;
+        count++;
+    }
+
+    editorDeleteMarked(drop);
+    free(drop);
+    editorSetStatusMessage("%d duplicate lines deleted", count);
+}
+
+// Keeps, or deletes, the rows matching an extended regular expression
+void editorFilterRows(char* pattern, int keep) {
+    regex_t regex;
+    int error = regcomp(&regex, pattern, REG_EXTENDED | REG_NOSUB);
+    if (error) {
+        char message[80];
+        regerror(error, &regex, message, sizeof(message));
+        editorSetStatusMessage("Bad pattern: %s", message);
+        return;
+    }
+
+    char* drop = malloc(E.num_rows + 1);
+    int count = 0;
+    for (int j = 0; j < E.num_rows; j++) {
+        int match = regexec(&regex, editorRowLine(&E.row[j]), 0, NULL, 0) == 0;
+        drop[j] = (match != keep);
+        count += drop[j];
+    }
+    regfree(&regex);
+
+    editorDeleteMarked(drop);
+    free(drop);
+    editorSetStatusMessage("%d lines deleted", count);
+}
+
+
+/*** Cursors ***/
+
+int editorCursorCompare(const void* a, const void* b) {
+    const editorCursor* left = a;
+    const editorCursor* right = b;
+    if (left->y != right->y) return left->y < right->y ? -1 : 1;
+    return (left->x > right->x) - (left->x < right->x);
+}
+
+void editorAddCursor(int y, int x) {
+    if (E.num_cursors == E.cursors_cap) {
+        E.cursors_cap = E.cursors_cap ? E.cursors_cap * 2 : 64;
+        E.cursors = realloc(E.cursors, sizeof(editorCursor) * E.cursors_cap);
+    }
+    E.cursors[E.num_cursors].y = y;
+    E.cursors[E.num_cursors].x = x;
+    E.num_cursors++;
+}
+
+// Display column of the primary cursor
+int editorCursorColumn() {
+    if (E.cursor_y >= E.num_rows) return 0;
+    return editorCursorxToRenderx(&E.row[E.cursor_y], E.cursor_x);
+}
+
+void editorClearCursors() {
+    if (E.block || E.num_cursors) E.redraw = 1;
+    E.block = 0;
+    E.num_cursors = 0;
+}
+
+// Ctrl-K: anchors a column block at the cursor; moving the cursor stretches it
+// and typing edits every row it covers. Pressing it again drops the block or
+// the extra cursors.
+void editorToggleBlock() {
+    if (E.block || E.num_cursors) {
+        editorClearCursors();
+        return;
+    }
+    if (E.cursor_y >= E.num_rows) return;
+
+    E.block = 1;
+    E.block_y = E.cursor_y;
+    E.block_column = editorCursorColumn();
+    E.redraw = 1;
+    editorSetStatusMessage("Block: move to select, type to edit every row (Ctrl-K or Esc to cancel)");
+}
+
+// Extra cursors are kept sorted with the primary cursor taken out, so each
+// row's cursors are adjacent and left to right
+void editorSetCursors(editorCursor* all, int count) {
+    qsort(all, count, sizeof(editorCursor), editorCursorCompare);
+
+    int primary = 0;
+    int unique = 0;
+    for (int j = 0; j < count; j++) {
+        if (unique && !editorCursorCompare(&all[unique - 1], &all[j])) continue;
+        all[unique++] = all[j];
+    }
+    for (int j = 0; j < unique; j++) {
+        if (all[j].y == E.cursor_y && all[j].x == E.cursor_x) primary = j;
+    }
+
+    E.num_cursors = 0;
+    for (int j = 0; j < unique; j++) {
+        if (j != primary) editorAddCursor(all[j].y, all[j].x);
+    }
+    E.cursor_y = all[primary].y;
+    E.cursor_x = all[primary].x;
+    E.redraw = 1;
+}
+
+// Every cursor, the primary one included; the caller frees the copy
+editorCursor* editorAllCursors(int* count) {
+    editorCursor* all = malloc(sizeof(editorCursor) * (E.num_cursors + 1));
+    memcpy(all, E.cursors, sizeof(editorCursor) * E.num_cursors);
+    all[E.num_cursors].y = E.cursor_y;
+    all[E.num_cursors].x = E.cursor_x;
+    *count = E.num_cursors + 1;
+    return all;
+}
+
+// Turns the block into one cursor per row at its left edge, cutting the
+// block's text first when `cut` is set. Rows too short to reach the block
+// get no cursor; the primary one goes to the row nearest the old cursor.
+// Returns the number of cursors placed.
+int editorBlockToCursors(int cut) {
+    int top = E.block_y < E.cursor_y ? E.block_y : E.cursor_y;
+    int bottom = E.block_y < E.cursor_y ? E.cursor_y : E.block_y;
+    int column = editorCursorColumn();
+    int left = E.block_column < column ? E.block_column : column;
+    int right = E.block_column < column ? column : E.block_column;
+
+    E.block = 0;
+    editorCursor* all = malloc(sizeof(editorCursor) * (bottom - top + 1));
+    int count = 0;
+    for (int y = top; y <= bottom && y < E.num_rows; y++) {
+        editorRow* row = &E.row[y];
+        if (row->hidden) continue;
+        editorRowThaw(row);
+        editorRowRender(row);
+        if (row->render_width < left) continue;
+
+        int from = editorRenderxToCursorx(row, editorRowIndexAt(row, left));
+        int to = editorRenderxToCursorx(row, editorRowIndexAt(row, right));
+        if (cut && to > from) {
+            memmove(&row->text->line[from], &row->text->line[to], row->size - to + 1);
+            row->size -= to - from;
+            editorUpdateRow(row);
+            E.dirty++;
+        }
+        all[count].y = y;
+        all[count].x = from;
+        count++;
+    }
+
+    E.redraw = 1;
+    if (count) {
+        int primary = 0;
+        for (int k = 1; k < count; k++) {
+            if (abs(all[k].y - E.cursor_y) < abs(all[primary].y - E.cursor_y)) primary = k;
+        }
+        E.cursor_y = all[primary].y;
+        E.cursor_x = all[primary].x;
+        editorSetCursors(all, count);
+    }
+    free(all);
+    return count;
+}
+
+// Applies one keystroke at every cursor: each touched row is rebuilt in a
+// single pass and updated once, however many cursors it holds
+void editorCursorsEdit(int key) {
+    int count;
+    editorCursor* all = editorAllCursors(&count);
+    qsort(all, count, sizeof(editorCursor), editorCursorCompare);
+
+    int primary_y = E.cursor_y, primary_x = E.cursor_x;
+    for (int first = 0; first < count; ) {
+        int last = first;
+        while (last < count && all[last].y == all[first].y) last++;
+
+        int y = all[first].y;
+        if (y >= E.num_rows) {
+            first = last;
+            continue;
+        }
+        editorRow* row = &E.row[y];
+        editorRowThaw(row);
+
+        char* line = malloc(row->size + (last - first) + 1);
+        int out = 0, copied = 0;
+        for (int k = first; k < last; k++) {
+            int x = all[k].x < row->size ? all[k].x : row->size;
+            if (x < copied) x = copied;
+            int floor = copied;
+            memcpy(&line[out], &row->text->line[copied], x - copied);
+            out += x - copied;
+            copied = x;
+
+            if (key == BACKSPACE || key == CTRL_KEY('h')) {
+                int at = editorRowPrevChar(row, x);
+                if (at < floor) at = floor;
+                out -= x - at;
+            } else if (key == DEL_KEY) {
+                copied = editorRowNextChar(row, x);
+            } else {
+                line[out++] = key;
+            }
+
+            int primary = (all[k].y == primary_y && all[k].x == primary_x);
+            all[k].x = out;
+            if (primary) {
+                E.cursor_y = y;
+                E.cursor_x = out;
+                primary_y = -1;
+            }
+        }
+        memcpy(&line[out], &row->text->line[copied], row->size - copied);
+        out += row->size - copied;
+        line[out] = '\0';
+
+        if (out != row->size || memcmp(line, row->text->line, out)) {
+            free(row->text->line);
+            row->text->line = line;
+            row->size = out;
+            editorUpdateRow(row);
+            E.dirty++;
+        } else {
+            free(line);
+        }
+        first = last;
+    }
+
+    editorSetCursors(all, count);
+    free(all);
+}
+
+// Arrow, Home and End keys move every cursor, each staying on its own row
+// for left and right
+void editorCursorsMove(int key) {
+    int count;
+    editorCursor* all = editorAllCursors(&count);
+
+    // The primary cursor is the last one in the list
+    for (int k = 0; k < count; k++) {
+        int y = all[k].y, x = all[k].x;
+        if (y >= E.num_rows) continue;
+
+        switch (key) {
+            case ARROW_LEFT: x = editorRowPrevChar(&E.row[y], x); break;
+            case ARROW_RIGHT: x = editorRowNextChar(&E.row[y], x); break;
+            case ARROW_UP: if (y > 0) y = editorPrevVisibleRow(y); break;
+            case ARROW_DOWN: if (y + 1 < E.num_rows) y = editorNextVisibleRow(y); break;
+            case HOME_KEY: x = 0; break;
+            case END_KEY: x = E.row[y].size; break;
+        }
+
+        editorRow* row = &E.row[y];
+        if (x > row->size) x = row->size;
+        if (x > 0 && x < row->size) {
+            editorRowThaw(row);
+            while (x > 0 && (row->text->line[x] & 0xC0) == 0x80) x--;
+        }
+        all[k].y = y;
+        all[k].x = x;
+    }
+    E.cursor_y = all[count - 1].y;
+    E.cursor_x = all[count - 1].x;
+
+    editorSetCursors(all, count);
+    free(all);
+}
+
+// Handles a key while a block or extra cursors are active. Returns 0 to let
+// the key through to the normal editing commands.
+int editorCursorsKeypress(int key) {
+    if (!E.block && !E.num_cursors) return 0;
+
+    switch (key) {
+        case '\x1b':
+            editorClearCursors();
+            return 1;
+        case CTRL_KEY('k'):
+            return 0;
+        case ARROW_UP:
+        case ARROW_DOWN:
+        case ARROW_LEFT:
+        case ARROW_RIGHT:
+        case HOME_KEY:
+        case END_KEY:
+            if (E.block) {
+                E.redraw = 1;
+                return 0;
+            }
+            editorCursorsMove(key);
+            return 1;
+        case BACKSPACE:
+        case CTRL_KEY('h'):
+        case DEL_KEY:
+            // A block with width is cut; an empty one becomes cursors
+            if (E.block) {
+                int cut = E.block_column != editorCursorColumn();
+                if (!editorBlockToCursors(1) || cut) return 1;
+            }
+            editorCursorsEdit(key);
+            return 1;
+    }
+
+    // Printable keys, tabs and the bytes of UTF-8 characters
+    if (key == '\t' || key < 0 || (key < 127 && !iscntrl(key))) {
+        if (E.block && !editorBlockToCursors(1)) {
+            editorSetStatusMessage("Block is past the end of every line");
+            return 1;
+        }
+        editorCursorsEdit(key);
+        return 1;
+    }
+
+    // New lines and paging drop the extra cursors; other commands keep them
+    if (key == '\r' || key == PAGE_UP || key == PAGE_DOWN) editorClearCursors();
+    return 0;
+}
+
+// Ctrl-E cursors RE: a cursor at every match of an extended regular expression
+void editorCursorsFromPattern(char* pattern) {
+    regex_t regex;
+    int error = regcomp(&regex, pattern, REG_EXTENDED);
+    if (error) {
+        char message[80];
+        regerror(error, &regex, message, sizeof(message));
+        editorSetStatusMessage("Bad pattern: %s", message);
+        return;
+    }
+
+    editorClearCursors();
+    int primary = -1;
+    for (int j = 0; j < E.num_rows; j++) {
+        if (E.row[j].hidden) continue;
+        char* line = editorRowLine(&E.row[j]);
+        int offset = 0;
+        regmatch_t match;
+        while (offset <= E.row[j].size &&
+               regexec(&regex, &line[offset], 1, &match, offset ? REG_NOTBOL : 0) == 0) {
+            int x = offset + match.rm_so;
+            editorAddCursor(j, x);
+            if (primary == -1 && (j > E.cursor_y || (j == E.cursor_y && x >= E.cursor_x)))
+                primary = E.num_cursors - 1;
+            offset += match.rm_eo > match.rm_so ? match.rm_eo : match.rm_so + 1;
+        }
+    }
+    regfree(&regex);
+
+    int count = E.num_cursors;
+    if (count == 0) {
+        editorSetStatusMessage("No matches");
+        return;
+    }
+    if (primary == -1) primary = 0;
+
+    // The match at or after the cursor becomes the primary cursor
+    E.cursor_y = E.cursors[primary].y;
+    E.cursor_x = E.cursors[primary].x;
+    memmove(&E.cursors[primary], &E.cursors[primary + 1], sizeof(editorCursor) * (count - primary - 1));
+    E.num_cursors--;
+    E.redraw = 1;
+    editorSetStatusMessage("%d cursors (Esc to drop)", count);
+}
+
+// Yields the rendered byte ranges of row `y` to show in inverse video: the
+// block, or the character under each extra cursor. `index` starts at 0.
+int editorNextMark(int y, editorRow* row, int* index, int* from, int* to) {
+    if (E.block) {
+        int top = E.block_y < E.cursor_y ? E.block_y : E.cursor_y;
+        int bottom = E.block_y < E.cursor_y ? E.cursor_y : E.block_y;
+        if ((*index)++ || y < top || y > bottom) return 0;
+
+        int column = editorCursorColumn();
+        int left = E.block_column < column ? E.block_column : column;
+        int right = E.block_column < column ? column : E.block_column;
+        if (row->render_width < left) return 0;
+        *from = editorRowIndexAt(row, left);
+        *to = editorRowIndexAt(row, right);
+    } else {
+        if (*index == 0) {
+            // First cursor on this row
+            int low = 0, high = E.num_cursors;
+            while (low < high) {
+                int middle = (low + high) / 2;
+                if (E.cursors[middle].y < y) low = middle + 1;
+                else high = middle;
+            }
+            *index = low + 1;
+        }
+        int k = *index - 1;
+        if (k >= E.num_cursors || E.cursors[k].y != y) return 0;
+        (*index)++;
+
+        int x = E.cursors[k].x < row->size ? E.cursors[k].x : row->size;
+        *from = editorRowIndexAt(row, editorCursorxToRenderx(row, x));
+        *to = *from;
+    }
+
+    // An empty range marks the character at its start, or the space past the
+    // end of the row
+    if (*to == *from) *to = editorRowIndexAt(row, editorRowColumn(row, *from) + 1);
+    if (*to == *from) (*to)++;
+    return 1;
+}
+
+/*** Buffers ***/
+
+// Files other than the one being edited wait in E.buffers as copies of E,
+// and the one switched to is copied back in. These fields belong to the
+// editor rather than to a file, so they are carried over.
+void editorShareGlobals(struct editorConfig* from) {
+    E.screen_rows = from->screen_rows;
+    E.drawn_row_offset = from->drawn_row_offset;
+    E.drawn_col_offset = from->drawn_col_offset;
+    E.drawn_first_row = from->drawn_first_row;
+    E.drawn_last_row = from->drawn_last_row;
+    E.redraw = 1;
+    E.fps = from->fps;
+    E.last_frame = from->last_frame;
+    E.watch_fd = from->watch_fd;
+    E.max_lines = from->max_lines;
+    E.macro = from->macro;
+    E.macro_length = from->macro_length;
+    E.macro_pos = from->macro_pos;
+    E.recording = from->recording;
+    E.replaying = from->replaying;
+    E.batch = from->batch;
+    E.stale_first = from->stale_first;
+    E.stale_last = from->stale_last;
+    E.search_failed = from->search_failed;
+    E.buffers = from->buffers;
+    E.num_buffers = from->num_buffers;
+    E.buffer_clock = from->buffer_clock;
+    E.memory_budget = from->memory_budget;
+    memcpy(E.status_message, from->status_message, sizeof(E.status_message));
+    E.status_message_time = from->status_message_time;
+    E.ORIGINAL_TERMIOS = from->ORIGINAL_TERMIOS;
+}
+
+// Adds a buffer for a file, which is read the first time it is switched to.
+// Returns its index.
+int editorAddBuffer(char* filename) {
+    struct editorConfig current = E;
+    initEditor();
+    E.filename = strdup(filename);
+    E.open_pending = 1;
+    E.screen_cols = current.screen_cols + current.gutter;
+    E.trigram = current.trigram;
+    struct editorConfig added = E;
+    E = current;
+
+    E.buffers = realloc(E.buffers, sizeof(struct editorConfig) * (E.num_buffers + 1));
+    E.buffers[E.num_buffers] = added;
+    return E.num_buffers++;
+}
+
+int editorFindBuffer(char* filename) {
+    char* wanted = realpath(filename, NULL);
+    int found = -1;
+    for (int j = 0; wanted && j < E.num_buffers && found == -1; j++) {
+        char* name = j == E.current_buffer ? E.filename : E.buffers[j].filename;
+        char* path = name ? realpath(name, NULL) : NULL;
+        if (path && !strcmp(path, wanted)) found = j;
+        free(path);
+    }
+    free(wanted);
+    return found;
+}
+
+// Followed streams, and loads with edits already made, can't be put aside
+int editorCanLeaveBuffer() {
+    if (E.stream_fd == -1 && (!E.loading || !E.dirty)) return 1;
+    editorSetStatusMessage("Can't switch buffers while %.30s is still being read", E.filename ? E.filename : "the input");
+    return 0;
+}
+
+int editorSwitchBuffer(int to) {
+    if (to == E.current_buffer) return 1;
+    if (!editorCanLeaveBuffer()) return 0;
+
+    editorLeaveBuffer();
+    E.buffers[E.current_buffer] = E;
+    struct editorConfig* from = &E.buffers[E.current_buffer];
+    E = E.buffers[to];
+    editorShareGlobals(from);
+    E.current_buffer = to;
+
+    editorSetStatusMessage("Buffer %d of %d: %.40s", to + 1, E.num_buffers, E.filename ? E.filename : "[No Name]");
+    editorEnterBuffer();
+    editorEnforceBudget();
+    return 1;
+}
+
+// Switches to the buffer holding a file, adding one if there is none.
+// Returns 0 if it can't be shown.
+int editorOpenBuffer(char* filename) {
+    int found = editorFindBuffer(filename);
+    if (found != -1) return editorSwitchBuffer(found);
+
+    if (access(filename, R_OK) == -1) {
+        editorSetStatusMessage("Can't open %.40s: %s", filename, strerror(errno));
+        return 0;
+    }
+    // An empty unnamed buffer is used instead of being left behind
+    if (!E.filename && E.num_rows == 0 && !E.dirty) {
+        editorOpen(filename);
+        return 1;
+    }
+    if (!editorCanLeaveBuffer()) return 0;
+    return editorSwitchBuffer(editorAddBuffer(filename));
+}
+
+void editorPromptOpen() {
+    char* filename = editorPrompt("Open: %s (ESC to cancel)", NULL);
+    if (!filename) return;
+    editorOpenBuffer(filename);
+    free(filename);
+}
+
+void editorNextBuffer() {
+    if (E.num_buffers < 2) {
+        editorSetStatusMessage("No other buffers, Ctrl-O opens one");
+        return;
+    }
+    editorSwitchBuffer((E.current_buffer + 1) % E.num_buffers);
+}
+
+int editorDirtyBuffers() {
+    int count = 0;
+    for (int j = 0; j < E.num_buffers; j++)
+        count += (j == E.current_buffer ? E.dirty : E.buffers[j].dirty) != 0;
+    return count;
+}
+
+void editorLeaveBuffer() {
+    // Buffers in the same directory would share a watch, so only E has one
+    if (E.watch_wd != -1) {
+        inotify_rm_watch(E.watch_fd, E.watch_wd);
+        E.watch_wd = -1;
+    }
+    // The loader thread works on E; a file still loading starts over later
+    if (E.loading) {
+        editorCancelLoad();
+        editorUnloadFile();
+    }
+    E.buffer_used = ++E.buffer_clock;
+}
+
+// Reads a file added or unloaded earlier, or catches up with changes made
+// to it on disk while it wasn't shown
+void editorEnterBuffer() {
+    if (E.spill) editorUnspillRows();
+    if (E.open_pending) {
+        E.open_pending = 0;
+        if (E.trigram && !E.trigram_table)
+            E.trigram_table = calloc(TRIGRAM_BUCKETS, sizeof(trigramPosting));
+        if (access(E.filename, R_OK) == -1) {
+            editorSetStatusMessage("New file %.40s", E.filename);
+            return;
+        }
+        char* filename = strdup(E.filename);
+        editorOpen(filename);
+        free(filename);
+        editorGotoPending();
+        return;
+    }
+    if (!E.watch_name) return;
+
+    if (editorDiskStateChanged()) {
+        if (E.dirty) {
+            E.disk_changed = 1;
+            editorSetStatusMessage("WARNING! %.20s changed on disk while you have unsaved changes", E.watch_name);
+        } else {
+            editorReloadFromDisk();
+        }
+    }
+    editorWatchFile();
+}
+
+void editorCancelLoad() {
+    pthread_mutex_lock(&E.load_lock);
+    E.load_cancel = 1;
+    pthread_cond_signal(&E.load_space);
+    pthread_mutex_unlock(&E.load_lock);
+    pthread_join(E.load_thread, NULL);
+    pthread_mutex_destroy(&E.load_lock);
+    pthread_cond_destroy(&E.load_space);
+
+    while (E.load_head) {
+        loadChunk* next = E.load_head->next;
+        free(E.load_head->data);
+        free(E.load_head);
+        E.load_head = next;
+    }
+    if (E.load_chunk) {
+        free(E.load_chunk->data);
+        free(E.load_chunk);
+    }
+    E.load_tail = NULL;
+    E.load_chunk = NULL;
+    E.load_queued = 0;
+    E.load_cancel = 0;
+    if (E.open_cache) editorDropOpenCache();
+
+    close(E.load_fd);
+    close(E.load_pipe[0]);
+    close(E.load_pipe[1]);
+    E.load_fd = -1;
+    E.loading = 0;
+}
+
+// Drops the rows of a file without unsaved changes, keeping the place in
+// it; the file is read again when the buffer is switched back to
+void editorUnloadFile() {
+    if (E.goto_row < 0) {
+        E.goto_row = E.cursor_y;
+        E.goto_column = E.cursor_x;
+        E.goto_offset = E.row_offest;
+    }
+    editorCloseFile();
+
+    free(E.row);
+    free(E.display_tree);
+    free(E.fold_ranges);
+    E.row = NULL;
+    E.display_tree = NULL;
+    E.fold_ranges = NULL;
+    E.folds_cap = 0;
+    E.display_tree_size = E.display_tree_cap = 0;
+    E.display_tree_stale = 1;
+    if (E.trigram_table) editorTrigramFree();
+    E.open_pending = 1;
+}
+
+// Rough number of bytes held by a buffer's rows and indexes
+long long editorBufferMemory(struct editorConfig* buffer) {
+    return (long long) buffer->num_rows * sizeof(editorRow) + buffer->row_bytes +
+           buffer->trigram_postings * sizeof(int) + (long long) buffer->word_count * (sizeof(wordEntry) + 32);
+}
+
+// Keeps all buffers together under the memory budget by taking from the
+// inactive ones, least recently used first: their rendering and colors,
+// then whole files, or the unedited rows of files with unsaved changes.
+// All of it comes back on use; edited rows and folds are never dropped.
+void editorEnforceBudget() {
+    if (E.num_buffers < 2) return;
+
+    long long total = editorBufferMemory(&E);
+    int* order = malloc(sizeof(int) * E.num_buffers);
+    int count = 0;
+    for (int j = 0; j < E.num_buffers; j++) {
+        if (j == E.current_buffer) continue;
+        total += editorBufferMemory(&E.buffers[j]);
+
+        int k = count++;
+        while (k > 0 && E.buffers[order[k - 1]].buffer_used > E.buffers[j].buffer_used) {
+            order[k] = order[k - 1];
+            k--;
+        }
+        order[k] = j;
+    }
+
+    int dropped = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        for (int k = 0; k < count && total > E.memory_budget; k++) {
+            struct editorConfig* buffer = &E.buffers[order[k]];
+            total -= editorBufferMemory(buffer);
+            if (pass == 0) editorBufferEvict(buffer);
+            else editorBufferUnload(buffer);
+            total += editorBufferMemory(buffer);
+            dropped = 1;
+        }
+    }
+    free(order);
+    if (total > E.memory_budget)
+        editorSetStatusMessage("Buffers hold %lld MB, over the %lld MB budget; edited rows stay loaded", total >> 20, E.memory_budget >> 20);
+
+#ifdef __GLIBC__
+    if (dropped) malloc_trim(0);
+#endif
+}
+
+void editorBufferEvict(struct editorConfig* buffer) {
+    for (int j = 0; j < buffer->num_rows; j++) {
+        editorRow* row = &buffer->row[j];
+        if (!row->text || row->text->render_stale || !row->text->render_line) continue;
+
+        if (!row->text->render_alias) free(row->text->render_line);
+        free(row->text->highlight);
+        free(row->text->columns);
+        row->text->render_line = NULL;
+        row->text->highlight = NULL;
+        row->text->columns = NULL;
+        row->text->highlight_spans = 0;
+        row->text->column_marks = 0;
+
+        long long bytes = editorRowBytes(row);
+        buffer->row_bytes += bytes - row->text->bytes;
+        row->text->bytes = bytes;
+    }
+}
+
+// Unchanged files are read again from disk, which is also what picks up any
+// change made to them meanwhile. Folds would be lost, so those stay. Files
+// with unsaved changes keep their edited rows and spill the rest.
+void editorBufferUnload(struct editorConfig* buffer) {
+    if (buffer->open_pending) return;
+    if (!buffer->dirty && (buffer->folds || !buffer->filename)) return;
+
+    struct editorConfig current = E;
+    E = *buffer;
+    if (E.dirty) editorSpillRows();
+    else editorUnloadFile();
+    *buffer = E;
+    E = current;
+}
+
+// Rows still as they were read or last saved
+int editorRowSpillable(editorRow* row) {
+    return (row->text || row->cold) && row->saved && row->hash == row->saved_hash;
+}
+
+// Moves the unedited rows to a temporary file, leaving them without text
+// until editorUnspillRows reads them back. The file on disk can't be used
+// for that, it may change meanwhile. Nothing is dropped if it can't be written.
+void editorSpillRows() {
+    if (E.spill) return;
+    FILE* spill = tmpfile();
+    if (!spill) return;
+
+    for (int j = 0; j < E.num_rows; j++) {
+        editorRow* row = &E.row[j];
+        if (editorRowSpillable(row) && fwrite(editorRowLine(row), 1, row->size + 1, spill) != (size_t) row->size + 1) {
+            fclose(spill);
+            return;
+        }
+    }
+    if (fflush(spill) != 0) {
+        fclose(spill);
+        return;
+    }
+
+    for (int j = 0; j < E.num_rows; j++) {
+        editorRow* row = &E.row[j];
+        if (!editorRowSpillable(row)) continue;
+        editorFreeRow(row);
+        row->cold = NULL;
+    }
+    E.spill = spill;
+}
+
+void editorUnspillRows() {
+    rewind(E.spill);
+    char* line = NULL;
+    int cap = 0;
+    for (int j = 0; j < E.num_rows; j++) {
+        editorRow* row = &E.row[j];
+        if (row->text || row->cold) continue;
+
+        if (row->size + 1 > cap) {
+            cap = row->size + 1;
+            line = realloc(line, cap);
+        }
+        if (fread(line, 1, row->size + 1, E.spill) != (size_t) row->size + 1) die("editorUnspillRows");
+        row->text = editorNewRowText(line, row->size);
+        if (row->words > 0) editorWordsLink(row);
+        editorRowRecount(row);
+    }
+    free(line);
+    fclose(E.spill);
+    E.spill = NULL;
+    if (E.num_rows >= COLD_MIN_ROWS) E.freeze_pending = 1;
+}
+
+
+/*** Server ***/
+
+// The socket lives in a directory only the user can enter, warm/ under
+// $XDG_RUNTIME_DIR or /tmp/warm-UID. Returns -1 if that directory is a
+// link, someone else's, or open to others.
+int editorServerPath(char* path, size_t size, int create) {
+    char directory[PATH_MAX];
+    char* runtime = getenv("XDG_RUNTIME_DIR");
+    if (runtime && *runtime)
+        snprintf(directory, sizeof(directory), "%s/warm", runtime);
+    else
+        snprintf(directory, sizeof(directory), "/tmp/warm-%d", (int) getuid());
+    if (create && mkdir(directory, 0700) == -1 && errno != EEXIST) return -1;
+
+    struct stat st;
+    if (lstat(directory, &st) == -1 || !S_ISDIR(st.st_mode) ||
+        st.st_uid != getuid() || (st.st_mode & 077))
+        return -1;
+    if (snprintf(path, size, "%s/warm.sock", directory) >= (int) size) return -1;
+    return 0;
+}
+
+// Keys and screen output only go to a process of the same user
+int editorPeerIsUser(int socket) {
+    struct ucred peer;
+    socklen_t length = sizeof(peer);
+    if (getsockopt(socket, SOL_SOCKET, SO_PEERCRED, &peer, &length) == -1) return 0;
+    return peer.uid == getuid();
+}
+
+// --server: accepts clients and hands each to the holder process of its
+// file, starting one on the first open. Holders keep the file loaded.
+void editorServe(int trigram) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (editorServerPath(address.sun_path, sizeof(address.sun_path), 1) == -1) {
+        fprintf(stderr, "warm: no private directory for the server socket\n");
+        exit(1);
+    }
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener == -1) die("socket failed");
+    if (connect(listener, (struct sockaddr*) &address, sizeof(address)) == 0) {
+        fprintf(stderr, "warm: a server is already running on %s\n", address.sun_path);
+        exit(1);
+    }
+    close(listener);
+
+    // A socket left by a server that died is replaced
+    listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(address.sun_path);
+    if (bind(listener, (struct sockaddr*) &address, sizeof(address)) == -1 ||
+        listen(listener, 16) == -1) {
+        perror("warm: can't listen");
+        exit(1);
+    }
+    signal(SIGCHLD, SIG_IGN);
+    printf("warm: serving on %s\n", address.sun_path);
+    fflush(stdout);
+
+    char** files = NULL;
+    int* channels = NULL;
+    int holders = 0;
+
+    while (1) {
+        int client = accept(listener, NULL, NULL);
+        if (client == -1) continue;
+        if (!editorPeerIsUser(client)) {
+            close(client);
+            continue;
+        }
+
+        // "rows cols fps path\n", which a stalled client has a second to send
+        // before it is dropped, so it can't hold up the next opens
+        char hello[PATH_MAX + 64];
+        int length = 0;
+        long long deadline = currentTimeMs() + SERVER_HELLO_MS;
+        while (length < (int) sizeof(hello) - 1) {
+            struct pollfd pfd = { client, POLLIN, 0 };
+            int wait = deadline - currentTimeMs();
+            if (wait <= 0 || poll(&pfd, 1, wait) <= 0 || read(client, &hello[length], 1) != 1) {
+                length = -1;
+                break;
+            }
+            if (hello[length] == '\n') break;
+            length++;
+        }
+        if (length == -1) {
+            close(client);
+            continue;
+        }
+        hello[length] = '\0';
+
+        char* path = hello;
+        for (int field = 0; field < 3 && path; field++) {
+            path = strchr(path, ' ');
+            if (path) path++;
+        }
+        if (!path || path[0] != '/') {
+            close(client);
+            continue;
+        }
+
+        int holder = 0;
+        while (holder < holders && strcmp(files[holder], path)) holder++;
+
+        for (int attempt = 0; attempt < 2; attempt++) {
+            if (holder == holders) {
+                int pair[2];
+                if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, pair) == -1) break;
+                if (fork() == 0) {
+                    close(listener);
+                    close(pair[0]);
+                    for (int j = 0; j < holders; j++) close(channels[j]);
+                    editorHold(path, pair[1], trigram);
+                }
+                close(pair[1]);
+
+                files = realloc(files, sizeof(char*) * (holders + 1));
+                channels = realloc(channels, sizeof(int) * (holders + 1));
+                files[holders] = strdup(path);
+                channels[holders] = pair[0];
+                holders++;
+            }
+            if (editorSendFd(channels[holder], client, hello, path - hello) == 0) break;
+
+            // The holder is gone: start over with a new one
+            close(channels[holder]);
+            free(files[holder]);
+            holders--;
+            files[holder] = files[holders];
+            channels[holder] = channels[holders];
+            holder = holders;
+        }
+        close(client);
+    }
+}
+
+// A holder loads its file once, keeps it current while idle, and forks a
+// session for every client; sessions share the loaded rows copy-on-write.
+void editorHold(char* filename, int channel, int trigram) {
+    dup2(channel, STDIN_FILENO);
+    close(channel);
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+    dup2(null, STDERR_FILENO);
+    close(null);
+
+    initEditor();
+    if (trigram) {
+        E.trigram = 1;
+        E.trigram_table = calloc(TRIGRAM_BUCKETS, sizeof(trigramPosting));
+    }
+    editorOpen(filename);
+
+    while (1) {
+        if (!editorInputPending(editorIdleWork() ? 0 : -1)) continue;
+
+        int client;
+        char hello[64];
+        if (editorReceiveFd(STDIN_FILENO, &client, hello, sizeof(hello)) == -1)
+            exit(0);
+        if (client == -1) continue;
+
+        // Sessions can't take over the loader thread
+        while (E.loading) {
+            if (!editorLoadRows()) editorInputPending(-1);
+        }
+
+        if (fork() == 0) editorAttach(client, hello);
+        close(client);
+    }
+}
+
+// Gives a session a pseudo-terminal of the client's size and relays between
+// the two; the editor itself runs in a child on the terminal's other side.
+void editorAttach(int client, char* hello) {
+    int rows = 24, cols = 80, fps = WARM_DEFAULT_FPS;
+    sscanf(hello, "%d %d %d", &rows, &cols, &fps);
+
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master == -1 || grantpt(master) == -1 || unlockpt(master) == -1) exit(1);
+    struct winsize window_size = { rows, cols, 0, 0 };
+    ioctl(master, TIOCSWINSZ, &window_size);
+
+    pid_t pid = fork();
+    if (pid == -1) exit(1);
+    if (pid > 0) {
+        editorRelay(client, client, master);
+        exit(0);
+    }
+
+    setsid();
+    int slave = open(ptsname(master), O_RDWR);
+    if (slave == -1) exit(1);
+    ioctl(slave, TIOCSCTTY, 0);
+    dup2(slave, STDIN_FILENO);
+    dup2(slave, STDOUT_FILENO);
+    dup2(slave, STDERR_FILENO);
+    close(slave);
+    close(master);
+    close(client);
+    signal(SIGCHLD, SIG_DFL);
+
+    // The holder's watch is its own
+    close(E.watch_fd);
+    E.watch_fd = -1;
+    E.watch_wd = -1;
+    editorWatchFile();
+
+    enableRawTerminalMode();
+    editorMeasureWindow();
+    editorRewrapRows();
+    E.fps = fps > 0 ? fps : WARM_DEFAULT_FPS;
+    E.redraw = 1;
+    editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find");
+    editorRun();
+}
+
+// Client side: hands this terminal to the server's session for filename and
+// exits when it ends. Returns if no server is running.
+void editorRemote(char* filename, int fps) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (editorServerPath(address.sun_path, sizeof(address.sun_path), 0) == -1) return;
+
+    char* path = realpath(filename, NULL);
+    int rows, cols;
+    if (!path || getWindowSize(&cols, &rows) == -1) {
+        free(path);
+        return;
+    }
+
+    int server = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server == -1 || connect(server, (struct sockaddr*) &address, sizeof(address)) == -1 ||
+        !editorPeerIsUser(server)) {
+        if (server != -1) close(server);
+        free(path);
+        return;
+    }
+
+    char* hello;
+    int length = asprintf(&hello, "%d %d %d %s\n", rows, cols, fps, path);
+    if (length == -1 || write(server, hello, length) != length) {
+        close(server);
+        free(path);
+        return;
+    }
+    free(hello);
+    free(path);
+
+    enableRawTerminalMode();
+    editorRelay(STDIN_FILENO, STDOUT_FILENO, server);
+    exit(0);
+}
+
+// Copies input to peer and peer to output until either side closes
+void editorRelay(int input, int output, int peer) {
+    char buffer[65536];
+    struct pollfd pfd[2] = {
+        { input, POLLIN, 0 },
+        { peer, POLLIN, 0 },
+    };
+
+    while (poll(pfd, 2, -1) > 0) {
+        for (int j = 0; j < 2; j++) {
+            if (!pfd[j].revents) continue;
+
+            ssize_t length = read(pfd[j].fd, buffer, sizeof(buffer));
+            if (length == -1 && errno == EAGAIN) continue;
+            if (length <= 0) return;
+
+            int to = j == 0 ? peer : output;
+            for (ssize_t written = 0; written < length; ) {
+                ssize_t n = write(to, buffer + written, length - written);
+                if (n <= 0) return;
+                written += n;
+            }
+        }
+    }
+}
+
+int editorSendFd(int channel, int fd, char* message, int length) {
+    struct iovec data = { message, length };
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+
+    struct msghdr header;
+    memset(&header, 0, sizeof(header));
+    header.msg_iov = &data;
+    header.msg_iovlen = 1;
+    header.msg_control = control;
+    header.msg_controllen = sizeof(control);
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&header);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    return sendmsg(channel, &header, MSG_NOSIGNAL) == length ? 0 : -1;
+}
+
+// Returns -1 once the channel is closed; *fd is -1 if no descriptor came
+int editorReceiveFd(int channel, int* fd, char* message, int size) {
+    struct iovec data = { message, size - 1 };
+    char control[CMSG_SPACE(sizeof(int))];
+
+    struct msghdr header;
+    memset(&header, 0, sizeof(header));
+    header.msg_iov = &data;
+    header.msg_iovlen = 1;
+    header.msg_control = control;
+    header.msg_controllen = sizeof(control);
+
+    ssize_t length = recvmsg(channel, &header, 0);
+    if (length <= 0) return -1;
+    message[length] = '\0';
+
+    *fd = -1;
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&header);
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+        memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+    return 0;
+}
+
+/*** Macros ***/
+
+void editorToggleRecording() {
+    if (E.recording) {
+        E.recording = 0;
+        editorSetStatusMessage("Recorded macro of %d keys (Ctrl-P to replay)", E.macro_length);
+    } else {
+        free(E.macro);
+        E.macro = NULL;
+        E.macro_length = 0;
+        E.recording = 1;
+        editorSetStatusMessage("Recording macro... (Ctrl-R to stop)");
+    }
+}
+
+void editorReplayMacro() {
+    if (E.recording || E.macro_length == 0) {
+        editorSetStatusMessage("No macro recorded");
+        return;
+    }
+
+    char* count = editorPrompt("Replay macro how many times: %s (empty = until search fails)", NULL);
+    if (count == NULL) return;
+
+    int times = atoi(count);
+    free(count);
+
+    int searches = 0;
+    for (int i = 0; i < E.macro_length; i++)
+        if (E.macro[i] == CTRL_KEY('f')) searches = 1;
+    if (times <= 0 && !searches) {
+        editorSetStatusMessage("Macro has no search, give a replay count");
+        return;
+    }
+    editorRunMacro(times);
+}
+
+// Replays the macro `count` times, or until a search in it fails when count
+// is 0. Screen refreshes and row renders are deferred until the end, and a
+// key press interrupts a long replay.
+void editorRunMacro(int count) {
+    int runs = 0;
+    int interrupted = 0;
+    E.batch = 1;
+
+    while (count <= 0 || runs < count) {
+        E.replaying = 1;
+        E.macro_pos = 0;
+        E.search_failed = 0;
+        // A failed search also skips the keys after it
+        while (E.macro_pos < E.macro_length && !(count <= 0 && E.search_failed))
+            editorProcessKeypress();
+        E.replaying = 0;
+
+        if (count <= 0 && E.search_failed) break;
+        runs++;
+        if (runs % 1024 == 0 && editorKeyWaiting()) {
+            // The key that stops the replay isn't acted on
+            editorReadTerminalKey();
+            interrupted = 1;
+            break;
+        }
+    }
+
+    E.batch = 0;
+    if (E.stale_first != -1) {
+        for (int j = E.stale_first; j <= E.stale_last && j < E.num_rows; j++) {
+            if (!E.row[j].cold && E.row[j].text->render_stale)
+                editorUpdateRow(&E.row[j]);
+        }
     }
+    E.stale_first = E.stale_last = -1;
+    E.redraw = 1;
+
+    editorSetStatusMessage("Macro replayed %d times%s", runs, interrupted ? " (interrupted)" : "");
 }
 
 void editorInsertRow(int at, char *s, size_t len) {
@@ -959,108 +6531,332 @@ void editorInsertRow(int at, char *s, size_t len) {
 
     E.row = realloc(E.row, sizeof(editorRow) * (E.num_rows + 1));
     memmove(&E.row[at + 1], &E.row[at], sizeof(editorRow) * (E.num_rows - at));
-    for (int j = at + 1; j < E.num_rows; j++)
+    for (int j = at + 1; j <= E.num_rows; j++) {
         E.row[j].index++;
+        if (E.trigram) E.id_rows[E.row[j].id] = j;
+    }
 
     E.row[at].index = at;
 
     E.row[at].size = len;
-    E.row[at].line = malloc(len + 1);
-    memcpy(E.row[at].line, s, len);
-    E.row[at].line[len] = '\0';
-
-    E.row[at].render_size = 0;
-    E.row[at].render_line = NULL;
-    E.row[at].highlight = NULL;
+    E.row[at].text = editorNewRowText(s, len);
+    E.row[at].render_width = 0;
     E.row[at].highlight_open_comment = 0;
+    E.row[at].highlight_stale = 0;
+    E.row[at].wrap_lines = 1;
+    E.row[at].cold = NULL;
+    E.row[at].cold_offset = 0;
+    E.row[at].hidden = editorFoldsInsertRow(at);
+    if (E.row[at].hidden) E.folded_rows++;
+    E.row[at].id = 0;
+    E.row[at].trigrams = 0;
+    E.row[at].words = 0;
+    E.row[at].hash = 0;
+    E.row[at].saved_hash = 0;
+    E.row[at].saved = 0;
+    E.row[at].removed_before = 0;
+    editorTrigramNewRow(&E.row[at]);
+    editorWordsNewRow(&E.row[at]);
+    if (E.stale_first != -1 && at <= E.stale_last)
+        E.stale_last++;
+
+    editorInvalidateRows(at, -1);
+    E.num_rows++;
+    if (E.num_rows >= COLD_MIN_ROWS) E.freeze_pending = 1;
+    if (editorDisplayMapped() && !E.display_tree_stale && at == E.display_tree_size) {
+        editorDisplayIndexAdd(at, editorRowDisplayLines(&E.row[at]));
+    } else {
+        E.display_tree_stale = 1;
+    }
 
     editorUpdateRow(&E.row[at]);
-
-    E.num_rows++;
     E.dirty++;
 }
 
 void editorDeleteRow(int at) {
     if (at < 0 || at >= E.num_rows) return;
+    editorFoldsDropRows(at, 1);
+    editorInvalidateRows(at, -1);
+    editorTrigramDrop(&E.row[at]);
+    editorWordsDrop(&E.row[at]);
+    editorIndexesDropRows(at, 1);
+    editorStaleDropRows(at, 1);
+    int removed = E.row[at].saved + E.row[at].removed_before;
     editorFreeRow(&E.row[at]);
     
     memmove(&E.row[at], &E.row[at + 1], sizeof(editorRow) * (E.num_rows - at - 1));
-    for (int j = at; j < E.num_rows - 1; j++)
+    E.display_tree_stale = 1;
+    for (int j = at; j < E.num_rows - 1; j++) {
         E.row[j].index--;
+        if (E.trigram) E.id_rows[E.row[j].id] = j;
+    }
 
     E.num_rows--;
+    // Saved rows that went away are marked on the row that took their place
+    if (at < E.num_rows) E.row[at].removed_before += removed;
+    else E.removed_tail += removed;
+    E.dirty++;
+}
+
+void editorDeleteRows(int at, int count) {
+    if (at < 0 || count <= 0 || at + count > E.num_rows) return;
+    editorFoldsDropRows(at, count);
+    editorInvalidateRows(at, -1);
+
+    int removed = 0;
+    for (int j = at; j < at + count; j++) {
+        editorTrigramDrop(&E.row[j]);
+        editorWordsDrop(&E.row[j]);
+        removed += E.row[j].saved + E.row[j].removed_before;
+        editorFreeRow(&E.row[j]);
+    }
+    editorIndexesDropRows(at, count);
+    editorStaleDropRows(at, count);
+
+    memmove(&E.row[at], &E.row[at + count], sizeof(editorRow) * (E.num_rows - at - count));
+    E.display_tree_stale = 1;
+    for (int j = at; j < E.num_rows - count; j++) {
+        E.row[j].index -= count;
+        if (E.trigram) E.id_rows[E.row[j].id] = j;
+    }
+
+    E.num_rows -= count;
+    if (at < E.num_rows) E.row[at].removed_before += removed;
+    else E.removed_tail += removed;
     E.dirty++;
 }
 
+// The initial builds of the indexes move back by the deleted rows they had
+// passed, counted against where they were before the delete
+void editorIndexesDropRows(int at, int count) {
+    int passed = E.trigram_next - at;
+    E.trigram_next -= passed < 0 ? 0 : passed > count ? count : passed;
+    passed = E.word_next - at;
+    E.word_next -= passed < 0 ? 0 : passed > count ? count : passed;
+}
+
+// Rows left to render after a batched replay move up with the rows deleted
+// above them
+void editorStaleDropRows(int at, int count) {
+    if (E.stale_first == -1) return;
+
+    int above = E.stale_first - at;
+    E.stale_first -= above < 0 ? 0 : above > count ? count : above;
+    above = E.stale_last + 1 - at;
+    E.stale_last -= above < 0 ? 0 : above > count ? count : above;
+    if (E.stale_last < E.stale_first) E.stale_first = E.stale_last = -1;
+}
+
 void editorFreeRow(editorRow* row) {
-    free(row->render_line);
-    free(row->line);
-    free(row->highlight);
+    if (row->cold) {
+        E.row_bytes -= editorRowBytes(row);
+        editorColdRelease(row->cold);
+    }
+    editorFreeRowText(row);
+}
+
+// A warm row's text: a copy of line, not rendered yet
+rowText* editorNewRowText(char* line, int size) {
+    rowText* text = malloc(sizeof(rowText));
+    text->line = malloc(size + 1);
+    memcpy(text->line, line, size);
+    text->line[size] = '\0';
+    text->render_line = NULL;
+    text->columns = NULL;
+    text->highlight = NULL;
+    text->word_ids = NULL;
+    text->render_size = 0;
+    text->highlight_spans = 0;
+    text->column_marks = 0;
+    text->edited_at = 0;
+    text->bytes = 0;
+    text->render_alias = 0;
+    text->render_stale = 0;
+    return text;
+}
+
+void editorFreeRowText(editorRow* row) {
+    rowText* text = row->text;
+    if (!text) return;
+
+    E.row_bytes -= text->bytes;
+    if (!text->render_alias) free(text->render_line);
+    free(text->line);
+    free(text->highlight);
+    free(text->columns);
+    free(text->word_ids);
+    free(text);
+    row->text = NULL;
+}
+
+// Bytes a row holds besides its stub: for a cold row, its share of the block
+long long editorRowBytes(editorRow* row) {
+    if (!row->text && !row->cold) return 0;
+    if (row->cold) return (long long)(row->size + 1) * row->cold->compressed_size / row->cold->raw_size;
+
+    rowText* text = row->text;
+    long long bytes = sizeof(rowText) + row->size + 1;
+    if (text->render_line && !text->render_alias) bytes += text->render_size + 1;
+    bytes += sizeof(columnMark) * text->column_marks;
+    bytes += sizeof(highlightSpan) * text->highlight_spans;
+    if (text->word_ids) bytes += sizeof(int) * row->words;
+    return bytes;
+}
+
+// Brings E.row_bytes up to date with what a warm row holds now
+void editorRowRecount(editorRow* row) {
+    long long bytes = editorRowBytes(row);
+    E.row_bytes += bytes - row->text->bytes;
+    row->text->bytes = bytes;
 }
 
 void editorScroll() {
     E.render_x = 0;
     if (E.cursor_y < E.num_rows) {
+        editorRowThaw(&E.row[E.cursor_y]);
         E.render_x = editorCursorxToRenderx(&E.row[E.cursor_y], E.cursor_x);
     }
 
-    if (E.cursor_y < E.row_offest) {
-        E.row_offest = E.cursor_y;
+    // Offsets count display lines; with wrapping a row may span several, and
+    // render_x becomes the column within the cursor's display line
+    E.render_y = editorRowToDisplay(E.cursor_y);
+    if (E.wrap) {
+        if (E.cursor_y < E.num_rows) {
+            editorRow* row = &E.row[E.cursor_y];
+            int line_start;
+            int line = editorRowWrap(row, E.render_x, INT_MAX, &line_start);
+            // Past the end of a row that fills its last line, the cursor
+            // stays in that line's last column
+            if (line >= row->wrap_lines) {
+                line = row->wrap_lines - 1;
+                editorRowWrap(row, INT_MAX, line, &line_start);
+            }
+            E.render_y += line;
+            E.render_x -= line_start;
+            if (E.render_x >= E.screen_cols) E.render_x = E.screen_cols - 1;
+        }
+        E.col_offset = 0;
+    }
+
+    if (E.render_y < E.row_offest) {
+        E.row_offest = E.render_y;
     }
-    if (E.cursor_y >= E.row_offest + E.screen_rows) {
-        E.row_offest = E.cursor_y - E.screen_rows + 1;
+    if (E.render_y >= E.row_offest + E.screen_rows) {
+        E.row_offest = E.render_y - E.screen_rows + 1;
     }
-    if (E.cursor_x < E.col_offset) {
+    if (E.wrap) return;
+
+    if (E.render_x < E.col_offset) {
         E.col_offset = E.render_x;
     }
-    if (E.cursor_x >= E.col_offset + E.screen_cols) {
+    if (E.render_x >= E.col_offset + E.screen_cols) {
         E.col_offset = E.render_x - E.screen_cols + 1;
     }
 }
 
 void editorUpdateRow(editorRow* row) {
-    free(row->render_line);
+    editorTrigramForget(row);
+    unsigned long long hash = editorHashLine(row->text->line, row->size);
+    // Rows rendered again with the same text keep their words
+    if (hash != row->hash) editorWordsUpdate(row);
+    row->hash = hash;
+
+    // Batched macro replay renders every touched row once, at the end
+    if (E.batch) {
+        if (row->text->render_alias) row->text->render_line = row->text->line;
+        row->text->render_stale = 1;
+        if (E.stale_first == -1 || row->index < E.stale_first) E.stale_first = row->index;
+        if (row->index > E.stale_last) E.stale_last = row->index;
+        editorRowRecount(row);
+        return;
+    }
+    row->text->render_stale = 0;
+    row->text->edited_at = ++E.edit_generation;
+    if (!row->text->render_alias) free(row->text->render_line);
 
     int tabs = 0;
     for (int j = 0; j < row->size; j++) {
-        if (row->line[j] == '\t')
+        if (row->text->line[j] == '\t')
             tabs++;
     }
 
-    row->render_line = malloc(row->size + (tabs * (TAB_SIZE - 1)) + 1);
-
-    int idx = 0;
-    for (int j = 0; j < row->size; j++) {
-        if (row->line[j] == '\t') {
-            row->render_line[idx++] = ' ';
-            while (idx % TAB_SIZE != 0)
-                row->render_line[idx++] = ' ';
-        } else {
-            row->render_line[idx++] = row->line[j];
+    // Without tabs the rendered row is the row itself, no copy needed
+    row->text->render_alias = (tabs == 0);
+    if (row->text->render_alias) {
+        row->text->render_line = row->text->line;
+        row->text->render_size = row->size;
+    } else {
+        row->text->render_line = malloc(row->size + (tabs * (TAB_SIZE - 1)) + 1);
+
+        int idx = 0;
+        for (int j = 0; j < row->size; j++) {
+            if (row->text->line[j] == '\t') {
+                row->text->render_line[idx++] = ' ';
+                while (idx % TAB_SIZE != 0)
+                    row->text->render_line[idx++] = ' ';
+            } else {
+                row->text->render_line[idx++] = row->text->line[j];
+            }
+        }
+        row->text->render_line[idx] = '\0';
+        row->text->render_size = idx;
+    }
+    editorRowMeasure(row);
+
+    int wrap_lines = editorRowWrapLines(row);
+    if (wrap_lines != row->wrap_lines) {
+        if (E.wrap && !row->hidden) {
+            editorDisplayIndexAdd(row->index, wrap_lines - row->wrap_lines);
+            // Keep the screen on the same rows when a row above it rewraps
+            if (row->index < E.drawn_first_row) {
+                E.row_offest += wrap_lines - row->wrap_lines;
+                E.drawn_row_offset += wrap_lines - row->wrap_lines;
+            }
         }
+        row->wrap_lines = wrap_lines;
     }
-    row->render_line[idx] = '\0';
-    row->render_size = idx;
 
     editorUpdateSyntax(row);
+    editorRowRecount(row);
+}
+
+// Brings a row whose update was deferred up to date before it is read
+void editorRowRender(editorRow* row) {
+    if (!row->text->render_stale) return;
+
+    int batch = E.batch;
+    E.batch = 0;
+    editorUpdateRow(row);
+    E.batch = batch;
+}
+
+// Also brings the colors of a row loaded through the open cache up to date
+void editorRowHighlight(editorRow* row) {
+    editorRowRender(row);
+    if (row->highlight_stale) editorUpdateSyntax(row);
 }
 
+// Returns the display column, which differs from the rendered byte offset
+// on rows with multibyte or wide characters
 int editorCursorxToRenderx(editorRow* row, int cursor_x) {
+    editorRowThaw(row);
+    editorRowRender(row);
     int render_x = 0;
     for (int j = 0; j < cursor_x; j++) {
-        if (row->line[j] == '\t')
+        if (row->text->line[j] == '\t')
             render_x += (TAB_SIZE - 1) - (render_x % TAB_SIZE);
         render_x++;
     }
 
-    return render_x;
+    return editorRowColumn(row, render_x);
 }
 
 int editorRenderxToCursorx(editorRow* row, int render_x) {
+    editorRowThaw(row);
     int curr = 0;
     int cursor_x;
     for (cursor_x = 0; cursor_x < row->size; cursor_x++) {
-        if (row->line[cursor_x] == '\t')
+        if (row->text->line[cursor_x] == '\t')
             curr += (TAB_SIZE - 1) - (curr % TAB_SIZE);
         curr++;
 
@@ -1074,31 +6870,37 @@ void editorRowInsertChar(editorRow *row, int at, int c) {
     if (at < 0 || at > row->size)
         at = row->size;
 
-    row->line = realloc(row->line, row->size + 2);
-    memmove(&row->line[at + 1], &row->line[at], row->size - at + 1);
+    editorRowThaw(row);
+    row->text->line = realloc(row->text->line, row->size + 2);
+    memmove(&row->text->line[at + 1], &row->text->line[at], row->size - at + 1);
     row->size++;
-    row->line[at] = c;
+    row->text->line[at] = c;
 
     editorUpdateRow(row);
     E.dirty++;
 }
 
-void editorRowDeleteChar(editorRow *row, int at) {
+// Deletes the length bytes of a character at once, so the row is never
+// left with part of one
+void editorRowDeleteChar(editorRow *row, int at, int length) {
     if (at < 0 || at >= row->size)
         return;
+    if (length > row->size - at) length = row->size - at;
 
-    memmove(&row->line[at], &row->line[at + 1], row->size - at);
-    row->size--;
+    editorRowThaw(row);
+    memmove(&row->text->line[at], &row->text->line[at + length], row->size - at - length + 1);
+    row->size -= length;
     editorUpdateRow(row);
     E.dirty++;
 }
 
 void editorRowAppendString(editorRow *row, char* s, size_t scs_length) {
-    row->line = realloc(row->line, row->size + scs_length + 1);
+    editorRowThaw(row);
+    row->text->line = realloc(row->text->line, row->size + scs_length + 1);
 
-    memcpy(&row->line[row->size], s, scs_length);
+    memcpy(&row->text->line[row->size], s, scs_length);
     row->size += scs_length;
-    row->line[row->size] = '\0';
+    row->text->line[row->size] = '\0';
     editorUpdateRow(row);
     E.dirty++;
 }
@@ -1108,16 +6910,19 @@ void editorInsertNewline() {
         editorInsertRow(E.cursor_y, "", 0);
     } else {
         editorRow* row = &E.row[E.cursor_y];
+        editorRowThaw(row);
 
-        editorInsertRow(E.cursor_y + 1, &row->line[E.cursor_x], row->size - E.cursor_x);
+        editorInsertRow(E.cursor_y + 1, &row->text->line[E.cursor_x], row->size - E.cursor_x);
         row = &E.row[E.cursor_y];
         row->size = E.cursor_x;
-        row->line[row->size] = '\0';
+        row->text->line[row->size] = '\0';
         editorUpdateRow(row);
     }
 
     E.cursor_y++;
     E.cursor_x = 0;
+    // Splitting a folded row puts the cursor in the fold
+    if (E.cursor_y < E.num_rows && E.row[E.cursor_y].hidden) editorUnfoldRange(E.cursor_y, 1);
 }
 
 void editorInsertChar(int c) {
@@ -1134,12 +6939,22 @@ void editorDeleteChar() {
 
     editorRow* row = &E.row[E.cursor_y];
     if (E.cursor_x > 0) {
-        editorRowDeleteChar(row, E.cursor_x - 1);
-        E.cursor_x--;
+        int at = editorRowPrevChar(row, E.cursor_x);
+        editorRowDeleteChar(row, at, E.cursor_x - at);
+        E.cursor_x = at;
     } else {
+        // Joining onto a folded row, show it first
+        if (E.row[E.cursor_y - 1].hidden) editorUnfoldRange(E.cursor_y - 1, 1);
+        editorRowThaw(row);
         E.cursor_x = E.row[E.cursor_y - 1].size;
-        editorRowAppendString(&E.row[E.cursor_y - 1], row->line, row->size);
+        editorRowAppendString(&E.row[E.cursor_y - 1], row->text->line, row->size);
+
+        // A folded row keeps its fold on the row it joined
+        int k = editorFoldSearch(E.cursor_y);
+        int fold_rows = k < E.folds && E.fold_ranges[k].header == E.cursor_y ? E.fold_ranges[k].rows : 0;
+        if (fold_rows) editorFoldListRemove(k);
         editorDeleteRow(E.cursor_y);
         E.cursor_y--;
+        if (fold_rows) editorFoldListInsert(E.cursor_y, fold_rows);
     }
 }